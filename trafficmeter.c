@@ -27,10 +27,27 @@
             Preparation for migrating from GTK+ 2.x to GTK+ 3
 
    0.0.7    Makefile bugfix (some more GTK+ 2.x to GTK+ 3 stuffs)
+
+   0.0.8    Binary usage journal replaces the text log file
+            Billing period reports from the journal (--report)
+            Periodic crash-safe checkpoints of the counter
+            Counters exported in shared memory (--watch, trafficmeter_shm.h)
+            Prometheus metrics endpoint on a Unix socket or loopback port
+            Optional per-process accounting with a sortable process view
+            Packets seen on several interfaces are only counted once
+            Outer and inner bytes per tunnel, --replay for recorded captures
+            Quota windows: rolling, calendar day and month, each with its
+              own limits and actions
+            Rate statistics: 1/5/15 minute averages, per second percentiles
+              and packet sizes (View / Statistics)
+            Interfaces listed in the background and followed on hotplug,
+              the device is stored by name
+            Idle mode: batched capture wakeups, no graph redraws while
+              hidden or flat, wakeups per minute and CPU time reported
 */
 
 
-#define VERSION "0.0.7"
+#define VERSION "0.0.8"
 
 #ifdef WIN32
 #define _WINSOCKAPI_
@@ -38,28 +55,52 @@
 /* NOTE: The windows version of chdir() does not accept NULL input! */
 #include <direct.h>
 #define chdir(path) ((path) != NULL ? _chdir(path) : -1)
+#include <io.h>
+#define fsync(fd) _commit(fd)
+#define ftruncate(fd, size) _chsize(fd, size)
+#define rename_replace(from, to) \
+  (MoveFileExA((from), (to), MOVEFILE_REPLACE_EXISTING) ? 0 : -1)
 #else /* !WIN32 */
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <errno.h>
+#define rename_replace(from, to) rename((from), (to))
 #endif /* !WIN32 */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <memory.h>
 #include <string.h>
 #include <time.h>
+#include <math.h>
 #include <pcap.h>
 #include <gtk/gtk.h>
+#include "trafficmeter_shm.h"
 
 #define SOFT_LIMIT 1800000000
 #define HARD_LIMIT 2000000000
 #define RCNAME  ".trafficmeterrc"
-#define LOGNAME ".trafficmeterlog"
+#define JOURNALNAME ".trafficmeterjournal"
 #define ENTRY_LENGTH_MAX 64
 #define GRAPH_WIDTH 100
 #define GRAPH_HEIGHT 25
 #define BAR_WIDTH 3
-
-FILE *log_file = NULL;
+#define METRICS_SPEC_LEN 108
+#define DEVICE_NAME_LEN 128
+#define WIREGUARD_PORT 51820
 
 GtkWidget *window = NULL;
 GtkWidget *bar = NULL;
@@ -74,7 +115,9 @@ GtkStatusIcon *tray_icon = NULL;
 GtkWidget *graph = NULL;
 
 
-/* ring buffer history for the histogram */
+/* ring buffer history for the histogram; a run of empty seconds is only
+   counted in zeros, and written into the ring when traffic is back or the
+   graph is drawn, so an idle meter does not touch the ring at all */
 
 typedef struct
 {
@@ -83,6 +126,7 @@ typedef struct
   unsigned int  head;
   unsigned int  tail;
   unsigned int  max;
+  unsigned int  zeros;            /* empty seconds not in data yet */
 } history_t;
 static history_t *history = NULL;
 
@@ -91,6 +135,7 @@ static void history_clr(history_t * h)
   h->head = 0;
   h->tail = 0;
   h->max  = 0;
+  h->zeros = 0;
   memset(h->data, 0, h->size * sizeof(unsigned int));
 }
 
@@ -131,55 +176,4389 @@ static unsigned int history_get_prev_pos(history_t *h, unsigned int pos)
     else
       pos = 1;
   }
-
-  return --pos;
+
+  return --pos;
+}
+
+static unsigned int history_get_data(history_t *h, unsigned int pos)
+{
+  return h->data[pos];
+}
+
+static void history_put(history_t *h, unsigned int v)
+{
+  unsigned int old = h->data[h->tail];
+
+  h->data[h->tail] = v;
+  
+  if (h->max > 0 && old == h->max) {
+    int x = 0;
+    h->max = 0;
+    for (x = 0; x < h->size; ++x)
+      if (h->data[x] > h->max)
+        h->max = h->data[x];
+  }
+
+  if (++h->tail == h->size) h->tail = 0;
+  if (h->tail == h->head)
+   if (++h->head == h->size)
+     h->head = 0;
+
+  if (v > h->max) h->max = v;
+}
+
+static void history_flush(history_t *h)
+{
+  unsigned int n = h->zeros;
+
+  h->zeros = 0;
+  while (n-- > 0)
+    history_put(h, 0);
+}
+
+static void history_add(history_t *h, unsigned int v)
+{
+  if (v == 0) {
+    if (h->zeros < h->size)
+      ++h->zeros;
+    return;
+  }
+  history_flush(h);
+  history_put(h, v);
+}
+
+/* nothing to draw: every bar of the graph is empty */
+static gboolean history_blank(history_t *h)
+{
+  return h->max == 0 || h->zeros == h->size;
+}
+
+
+/*
+ * rate statistics
+ *
+ * Fed with the bytes of every completed second, like the history above:
+ * exponentially weighted moving averages over 1, 5 and 15 minutes in the
+ * manner of the load average, and a log-linear histogram of the per second
+ * rates in the manner of HdrHistogram. Recording is O(1) into a fixed
+ * number of counters: values below RATE_HIST_SUB are exact, above that
+ * every power of two is split into RATE_HIST_SUB / 2 buckets, so a
+ * percentile is off by less than 2 / RATE_HIST_SUB (about 3%).
+ */
+
+#define RATE_HIST_SUB_BITS 6
+#define RATE_HIST_SUB (1 << RATE_HIST_SUB_BITS)
+#define RATE_HIST_BUCKETS ((32 - RATE_HIST_SUB_BITS + 2) * (RATE_HIST_SUB / 2))
+#define RATE_EWMAS 3
+#define PKT_SIZES TM_SHM_SIZES
+
+static const double rate_ewma_period[RATE_EWMAS] = { 60.0, 300.0, 900.0 };
+
+/* upper bounds of the packet size classes as in RFC 2819, the last is open */
+static const guint32 pkt_size_max[PKT_SIZES - 1] = { 64, 127, 255, 511, 1023, 1518 };
+
+typedef struct
+{
+  guint32 count[RATE_HIST_BUCKETS];
+  guint64 total;
+} rate_hist_t;
+
+typedef struct
+{
+  double rate[RATE_EWMAS];        /* bytes per second */
+} rate_ewma_t;
+
+typedef struct
+{
+  rate_ewma_t ewma;
+  rate_hist_t hist;
+  guint32     last;               /* bytes in the last second */
+  gint64      time;               /* of the last second */
+  guint64     seconds;            /* counted since the last reset */
+  guint64     bytes;
+  guint64     sizes[PKT_SIZES];   /* packets per size class */
+  guint64     size_sum;           /* bytes of those packets */
+} rate_stats_t;
+
+static guint rate_hist_index(guint32 v)
+{
+  guint shift;
+
+  if (v < RATE_HIST_SUB)
+    return v;
+  shift = g_bit_storage(v) - RATE_HIST_SUB_BITS;
+  return shift * (RATE_HIST_SUB / 2) + (v >> shift);
+}
+
+/* the highest value that goes into bucket i */
+static guint32 rate_hist_value(guint i)
+{
+  guint shift;
+
+  if (i < RATE_HIST_SUB)
+    return i;
+  shift = i / (RATE_HIST_SUB / 2) - 1;
+  return (guint32)((((guint64)i - shift * (RATE_HIST_SUB / 2) + 1) << shift) - 1);
+}
+
+static void rate_hist_add(rate_hist_t *h, guint32 v)
+{
+  ++h->count[rate_hist_index(v)];
+  ++h->total;
+}
+
+static void rate_hist_merge(rate_hist_t *to, const rate_hist_t *from)
+{
+  guint i;
+
+  for (i = 0; i < RATE_HIST_BUCKETS; ++i)
+    to->count[i] += from->count[i];
+  to->total += from->total;
+}
+
+/* the value below which pct percent of the recorded values are */
+static guint32 rate_hist_percentile(const rate_hist_t *h, unsigned int pct)
+{
+  guint64 rank = (h->total * pct + 99) / 100;
+  guint64 n = 0;
+  guint i;
+
+  if (h->total == 0)
+    return 0;
+  for (i = 0; i < RATE_HIST_BUCKETS; ++i) {
+    n += h->count[i];
+    if (n >= rank && n > 0)
+      return rate_hist_value(i);
+  }
+  return rate_hist_value(RATE_HIST_BUCKETS - 1);
+}
+
+/* adds v bytes in a second after idle seconds without traffic */
+static void rate_ewma_add(rate_ewma_t *e, guint32 v, guint64 idle)
+{
+  int i;
+
+  for (i = 0; i < RATE_EWMAS; ++i) {
+    if (idle > 0)
+      e->rate[i] *= exp(-(double)idle / rate_ewma_period[i]);
+    e->rate[i] += (v - e->rate[i]) * (1.0 - exp(-1.0 / rate_ewma_period[i]));
+  }
+}
+
+static guint pkt_size_class(guint32 len)
+{
+  if (len <= 64)
+    return 0;
+  if (len > 1518)
+    return PKT_SIZES - 1;
+  return g_bit_storage(len) - 6;
+}
+
+/* live statistics, protected by data_mutex */
+static rate_stats_t stats;
+
+static void rate_stats_packet(rate_stats_t *s, guint32 len)
+{
+  ++s->sizes[pkt_size_class(len)];
+  s->size_sum += len;
+}
+
+static void rate_stats_clear(rate_stats_t *s)
+{
+  memset(s, 0, sizeof(*s));
+}
+
+/* the averages decay over the seconds that were not metered, e.g. while
+   stopped, the histogram and the totals only take metered seconds */
+static void rate_stats_second(rate_stats_t *s, guint32 b, gint64 now)
+{
+  gint64 idle = s->seconds > 0 ? now - s->time - 1 : 0;
+
+  rate_ewma_add(&s->ewma, b, idle > 0 ? idle : 0);
+  rate_hist_add(&s->hist, b);
+  s->last = b;
+  s->time = now;
+  ++s->seconds;
+  s->bytes += b;
+}
+
+
+/* wall clock in microseconds, GLib 2.22 of the Windows bundle has no
+   g_get_monotonic_time() */
+static gint64 time_usec(void)
+{
+  GTimeVal tv;
+
+  g_get_current_time(&tv);
+  return (gint64)tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+}
+
+
+/*
+ * binary usage journal
+ *
+ * The journal is a sequence of JOURNAL_BLOCK_SIZE blocks. Every block
+ * starts with a header carrying the absolute time, counter value and device
+ * name, followed by fixed-size records holding only the time and byte
+ * deltas. Records are only ever appended; the unused tail of a block is
+ * zero, i.e. JOURNAL_NONE. As block headers are at fixed offsets, they
+ * form a sparse time index that can be binary searched in the mapped file.
+ */
+
+#define JOURNAL_MAGIC "TMJ1"
+#define JOURNAL_VERSION 1
+#define JOURNAL_BLOCK_SIZE 4096
+#define JOURNAL_DEV_LEN 32
+#define JOURNAL_BATCH 60       /* records collected before writing */
+#define JOURNAL_FLUSH_SEC 10   /* max. time a record may wait for writing */
+#define JOURNAL_SYNC_SEC 60    /* default fsync interval, 0: never */
+
+typedef enum { JOURNAL_NONE = 0
+             , JOURNAL_SAMPLE
+             , JOURNAL_START
+             , JOURNAL_STOP
+             , JOURNAL_RESET
+             , JOURNAL_QUIT
+             , JOURNAL_QUOTA_OK         /* arg: the quota window */
+             , JOURNAL_QUOTA_SOFT
+             , JOURNAL_QUOTA_HARD
+             } journal_type_t;
+
+static const char *journal_type_name[] =
+  { "NONE", "SAMPLE", "START", "STOP", "RESET", "QUIT",
+    "QUOTA_OK", "QUOTA_SOFT", "QUOTA_HARD" };
+
+typedef struct
+{
+  char    magic[4];
+  guint16 version;
+  guint16 record_size;
+  gint64  base_time;              /* seconds since the epoch */
+  guint64 base_bytes;             /* counter value before the first record */
+  char    dev[JOURNAL_DEV_LEN];
+  guint8  reserved[8];
+} journal_block_hdr_t;
+
+typedef struct
+{
+  guint16 dt;                     /* seconds since the previous record */
+  guint8  type;                   /* journal_type_t */
+  guint8  arg;                    /* depends on the type, 0 if unused */
+  guint32 bytes;                  /* bytes counted in the interval */
+} journal_rec_t;
+
+#define JOURNAL_RECS_PER_BLOCK \
+  ((JOURNAL_BLOCK_SIZE - sizeof(journal_block_hdr_t)) / sizeof(journal_rec_t))
+
+typedef struct
+{
+  gint64         time;
+  journal_type_t type;
+  guint8         arg;
+  guint32        bytes;
+  guint64        counter;         /* counter value after the record */
+  char           dev[JOURNAL_DEV_LEN];
+} journal_entry_t;
+
+typedef struct
+{
+  FILE         *file;
+  GAsyncQueue  *queue;
+  GThread      *thread;
+  unsigned int  sync_interval;
+  /* the rest is owned by the writer thread */
+  guint64       offset;           /* size of the file */
+  gint64        last_time;
+  gint64        last_sync;
+  gint64        deadline;         /* latest time to write out buf */
+  unsigned int  pending;          /* records in buf */
+  unsigned int  block_recs;       /* records in the current block */
+  char          dev[JOURNAL_DEV_LEN];
+  gsize         len;
+  guint8        buf[2 * JOURNAL_BLOCK_SIZE];
+} journal_t;
+static journal_t *journal = NULL;
+
+static void journal_flush(journal_t *j, gboolean sync)
+{
+  gint64 now = time(NULL);
+
+  if (j->len > 0) {
+    if (fwrite(j->buf, 1, j->len, j->file) != j->len || fflush(j->file) != 0) {
+      g_printerr("journal: write failed, continuing with a new block\n");
+      clearerr(j->file);
+      (void) fseek(j->file, 0, SEEK_END);
+      j->offset = ftell(j->file);
+      j->block_recs = JOURNAL_RECS_PER_BLOCK;
+    } else {
+      j->offset += j->len;
+    }
+    j->len = 0;
+    j->pending = 0;
+  }
+
+  if (sync || (j->sync_interval > 0 && now - j->last_sync >= j->sync_interval)) {
+    (void) fsync(fileno(j->file));
+    j->last_sync = now;
+  }
+}
+
+static void journal_put(journal_t *j, const journal_entry_t *e)
+{
+  journal_rec_t rec;
+  /* a clock stepping back must not break the time order of the blocks,
+     such records are kept at the time of the previous one */
+  gint64 t = MAX(e->time, j->last_time);
+
+  if (   j->block_recs >= JOURNAL_RECS_PER_BLOCK
+      || t - j->last_time > G_MAXUINT16
+      || strcmp(e->dev, j->dev) != 0) {
+    journal_block_hdr_t hdr;
+    gsize pad = (JOURNAL_BLOCK_SIZE - (j->offset + j->len) % JOURNAL_BLOCK_SIZE)
+                % JOURNAL_BLOCK_SIZE;
+
+    if (j->len + pad + sizeof(hdr) + sizeof(rec) > sizeof(j->buf))
+      journal_flush(j, FALSE);
+    memset(j->buf + j->len, 0, pad);
+    j->len += pad;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+    hdr.version = JOURNAL_VERSION;
+    hdr.record_size = sizeof(journal_rec_t);
+    hdr.base_time = t;
+    hdr.base_bytes = e->counter - (e->type == JOURNAL_SAMPLE ? e->bytes : 0);
+    g_strlcpy(hdr.dev, e->dev, sizeof(hdr.dev));
+    memcpy(j->buf + j->len, &hdr, sizeof(hdr));
+    j->len += sizeof(hdr);
+
+    g_strlcpy(j->dev, e->dev, sizeof(j->dev));
+    j->last_time = t;
+    j->block_recs = 0;
+  } else if (j->len + sizeof(rec) > sizeof(j->buf)) {
+    journal_flush(j, FALSE);
+  }
+
+  rec.dt = (guint16)(t - j->last_time);
+  rec.type = e->type;
+  rec.arg = e->arg;
+  rec.bytes = e->bytes;
+  memcpy(j->buf + j->len, &rec, sizeof(rec));
+  j->len += sizeof(rec);
+
+  j->last_time = t;
+  ++j->block_recs;
+  if (j->pending++ == 0)
+    j->deadline = time(NULL) + JOURNAL_FLUSH_SEC;
+}
+
+/* background writer: batches the queued records and appends them */
+static gpointer journal_writer(gpointer data)
+{
+  journal_t *j = (journal_t *)data;
+  journal_entry_t *e;
+
+  for (;;) {
+    if (j->pending == 0) {
+      e = (journal_entry_t *)g_async_queue_pop(j->queue);
+    } else {
+      GTimeVal until;
+      until.tv_sec = j->deadline;
+      until.tv_usec = 0;
+      e = (journal_entry_t *)g_async_queue_timed_pop(j->queue, &until);
+      if (e == NULL) {
+        journal_flush(j, FALSE);
+        continue;
+      }
+    }
+
+    if (e->type == JOURNAL_NONE) {
+      g_free(e);
+      break;
+    }
+
+    journal_put(j, e);
+
+    /* events are rare but the most important records, write them at once */
+    if (j->pending >= JOURNAL_BATCH || e->type != JOURNAL_SAMPLE)
+      journal_flush(j, FALSE);
+    g_free(e);
+  }
+
+  journal_flush(j, TRUE);
+  return NULL;
+}
+
+static journal_t * journal_open(const char *path, unsigned int sync_interval)
+{
+  GError *error = NULL;
+  journal_t *j = (journal_t *)g_malloc0(sizeof(journal_t));
+
+  j->file = fopen(path, "ab");
+  if (j->file == NULL) {
+    g_free(j);
+    return NULL;
+  }
+  (void) fseek(j->file, 0, SEEK_END);
+  j->offset = ftell(j->file);
+  j->sync_interval = sync_interval;
+  j->last_sync = time(NULL);
+  j->block_recs = JOURNAL_RECS_PER_BLOCK; /* always start a new block */
+  j->queue = g_async_queue_new();
+
+  j->thread = g_thread_create(&journal_writer, j, TRUE, &error);
+  if (j->thread == NULL) {
+    g_printerr("Failed to create journal thread: %s\n", error->message);
+    g_error_free(error);
+    g_async_queue_unref(j->queue);
+    fclose(j->file);
+    g_free(j);
+    return NULL;
+  }
+  return j;
+}
+
+static void journal_append_arg(journal_t *j, journal_type_t type, guint8 arg,
+                               guint32 bytes, unsigned long long counter,
+                               const gchar *dev)
+{
+  journal_entry_t *e;
+
+  if (j == NULL)
+    return;
+
+  e = (journal_entry_t *)g_malloc(sizeof(journal_entry_t));
+  e->time = time(NULL);
+  e->type = type;
+  e->arg = arg;
+  e->bytes = bytes;
+  e->counter = counter;
+  g_strlcpy(e->dev, dev != NULL ? dev : "", sizeof(e->dev));
+  g_async_queue_push(j->queue, e);
+}
+
+static void journal_append(journal_t *j, journal_type_t type, guint32 bytes,
+                           unsigned long long counter, const gchar *dev)
+{
+  journal_append_arg(j, type, 0, bytes, counter, dev);
+}
+
+static void journal_close(journal_t *j)
+{
+  if (j == NULL)
+    return;
+
+  /* JOURNAL_NONE stops the writer after everything queued is written */
+  g_async_queue_push(j->queue, g_malloc0(sizeof(journal_entry_t)));
+  g_thread_join(j->thread);
+  g_async_queue_unref(j->queue);
+  fclose(j->file);
+  g_free(j);
+}
+
+
+/* journal reader, maps the whole file and walks only the needed blocks */
+
+typedef struct
+{
+  const guint8 *data;
+  gsize         size;
+  unsigned int  blocks;
+} journal_map_t;
+
+typedef struct
+{
+  gint64          time;
+  journal_type_t  type;
+  guint8          arg;
+  guint32         bytes;
+  guint64         counter;        /* counter value after the record */
+  const char     *dev;
+} journal_sample_t;
+
+typedef struct
+{
+  const journal_map_t *map;
+  unsigned int  blk;
+  unsigned int  rec;
+  unsigned int  nrecs;
+  gint64        time;
+  guint64       counter;
+  char          dev[JOURNAL_DEV_LEN + 1];
+} journal_iter_t;
+
+static const journal_block_hdr_t * journal_block(const journal_map_t *m,
+                                                 unsigned int blk)
+{
+  const journal_block_hdr_t *hdr;
+  gsize off = (gsize)blk * JOURNAL_BLOCK_SIZE;
+
+  if (off + sizeof(journal_block_hdr_t) > m->size)
+    return NULL;
+  hdr = (const journal_block_hdr_t *)(m->data + off);
+  if (   memcmp(hdr->magic, JOURNAL_MAGIC, sizeof(hdr->magic)) != 0
+      || hdr->record_size != sizeof(journal_rec_t))
+    return NULL;
+  return hdr;
+}
+
+static const journal_rec_t * journal_block_recs(const journal_map_t *m,
+                                                unsigned int blk)
+{
+  return (const journal_rec_t *)(m->data + (gsize)blk * JOURNAL_BLOCK_SIZE
+                                 + sizeof(journal_block_hdr_t));
+}
+
+/* number of records in a block: used records form a prefix, search its end */
+static unsigned int journal_block_nrecs(const journal_map_t *m, unsigned int blk)
+{
+  const journal_rec_t *recs = journal_block_recs(m, blk);
+  gsize avail = m->size - (gsize)blk * JOURNAL_BLOCK_SIZE
+                - sizeof(journal_block_hdr_t);
+  unsigned int lo = 0;
+  unsigned int hi = MIN(JOURNAL_RECS_PER_BLOCK, avail / sizeof(journal_rec_t));
+
+  while (lo < hi) {
+    unsigned int mid = (lo + hi) / 2;
+    if (recs[mid].type != JOURNAL_NONE)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static gboolean journal_map(const char *path, journal_map_t *m)
+{
+#ifdef WIN32
+  gchar *contents = NULL;
+
+  if (!g_file_get_contents(path, &contents, &m->size, NULL))
+    return FALSE;
+  m->data = (const guint8 *)contents;
+#else /* !WIN32 */
+  struct stat st;
+  void *data;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0)
+    return FALSE;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return FALSE;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return FALSE;
+  m->data = (const guint8 *)data;
+  m->size = st.st_size;
+#endif /* !WIN32 */
+
+  /* a block torn by a crash is the last one, those left by a failed
+     write in the middle are skipped by the readers */
+  m->blocks = (m->size + JOURNAL_BLOCK_SIZE - 1) / JOURNAL_BLOCK_SIZE;
+  while (m->blocks > 0 && journal_block(m, m->blocks - 1) == NULL)
+    --m->blocks;
+  return TRUE;
+}
+
+static void journal_unmap(journal_map_t *m)
+{
+#ifdef WIN32
+  g_free((gpointer)m->data);
+#else /* !WIN32 */
+  munmap((void *)m->data, m->size);
+#endif /* !WIN32 */
+  m->data = NULL;
+}
+
+/* last block starting at or before t, blocks are in time order; an invalid
+   block is searched as if it had the time of the next valid one */
+static unsigned int journal_find_block(const journal_map_t *m, gint64 t)
+{
+  unsigned int lo = 0;
+  unsigned int hi = m->blocks;
+
+  while (lo < hi) {
+    unsigned int mid = (lo + hi) / 2;
+    unsigned int probe = mid;
+    const journal_block_hdr_t *hdr = NULL;
+
+    while (probe < hi && (hdr = journal_block(m, probe)) == NULL)
+      ++probe;
+    if (hdr != NULL && hdr->base_time <= t)
+      lo = probe + 1;
+    else
+      hi = mid;
+  }
+  return lo > 0 ? lo - 1 : 0;
+}
+
+static gboolean journal_iter_load(journal_iter_t *it)
+{
+  const journal_block_hdr_t *hdr;
+
+  for (; it->blk < it->map->blocks; ++it->blk) {
+    hdr = journal_block(it->map, it->blk);
+    it->rec = 0;
+    it->nrecs = 0;
+    if (hdr == NULL)
+      continue;
+    it->nrecs = journal_block_nrecs(it->map, it->blk);
+    if (it->nrecs == 0)
+      continue;
+    it->time = hdr->base_time;
+    it->counter = hdr->base_bytes;
+    memcpy(it->dev, hdr->dev, JOURNAL_DEV_LEN);
+    it->dev[JOURNAL_DEV_LEN] = '\0';
+    return TRUE;
+  }
+  return FALSE;
+}
+
+static void journal_iter_init(journal_iter_t *it, const journal_map_t *m,
+                              gint64 from)
+{
+  it->map = m;
+  it->blk = journal_find_block(m, from);
+  it->rec = 0;
+  it->nrecs = 0;
+}
+
+/* the caller skips records before its range and stops after it */
+static gboolean journal_iter_next(journal_iter_t *it, journal_sample_t *s)
+{
+  const journal_rec_t *r;
+
+  if (it->rec >= it->nrecs) {
+    if (it->nrecs > 0)
+      ++it->blk;
+    if (!journal_iter_load(it))
+      return FALSE;
+  }
+
+  r = journal_block_recs(it->map, it->blk) + it->rec++;
+  it->time += r->dt;
+  if (r->type == JOURNAL_SAMPLE)
+    it->counter += r->bytes;
+  else if (r->type == JOURNAL_RESET)
+    it->counter = 0;
+
+  s->time = it->time;
+  s->type = (journal_type_t)r->type;
+  s->arg = r->arg;
+  s->bytes = r->bytes;
+  s->counter = it->counter;
+  s->dev = it->dev;
+  return TRUE;
+}
+
+/* "YYYY-MM-DD", "YYYY-MM-DD HH:MM[:SS]" in local time or "@<epoch seconds>" */
+static gboolean parse_time(const char *text, gint64 *t)
+{
+  struct tm tm;
+  int n;
+
+  if (text[0] == '@') {
+    char *end = NULL;
+    *t = g_ascii_strtoll(text + 1, &end, 10);
+    return end != text + 1 && *end == '\0';
+  }
+
+  memset(&tm, 0, sizeof(tm));
+  n = sscanf(text, "%d-%d-%d%*c%d:%d:%d", &tm.tm_year, &tm.tm_mon,
+             &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+  if (n != 3 && n != 5 && n != 6)
+    return FALSE;
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  tm.tm_isdst = -1;
+  *t = mktime(&tm);
+  return *t != -1;
+}
+
+/* trafficmeter --dump [FROM [TO]]: print the journal as text, with the
+   1, 5 and 15 minute averages after each record */
+static int journal_dump(int argc, char *argv[])
+{
+  journal_map_t map;
+  journal_iter_t it;
+  journal_sample_t s;
+  rate_stats_t *st = g_new0(rate_stats_t, 1);
+  gint64 from = 0;
+  gint64 to = G_MAXINT64;
+
+  if (   (argc > 0 && !parse_time(argv[0], &from))
+      || (argc > 1 && !parse_time(argv[1], &to))) {
+    fprintf(stderr, "usage: trafficmeter --dump [FROM [TO]]\n"
+                    "  times as YYYY-MM-DD[ HH:MM[:SS]] or @seconds\n");
+    g_free(st);
+    return 2;
+  }
+
+  if (!journal_map(JOURNALNAME, &map)) {
+    fprintf(stderr, "Unable to read %s\n", JOURNALNAME);
+    g_free(st);
+    return 1;
+  }
+
+  journal_iter_init(&it, &map, from);
+  while (journal_iter_next(&it, &s) && s.time < to) {
+    char timetxt[32];
+    char typetxt[32];
+    time_t t = (time_t)s.time;
+
+    /* the samples of the block before FROM warm up the averages */
+    if (s.type == JOURNAL_SAMPLE)
+      rate_stats_second(st, s.bytes, s.time);
+    if (s.time < from)
+      continue;
+    strftime(timetxt, sizeof(timetxt), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    g_strlcpy(typetxt,
+              journal_type_name[s.type < G_N_ELEMENTS(journal_type_name) ? s.type : 0],
+              sizeof(typetxt));
+    /* quota records name the window, e.g. QUOTA_SOFT/1 */
+    if (s.type >= JOURNAL_QUOTA_OK && s.type <= JOURNAL_QUOTA_HARD)
+      g_snprintf(typetxt + strlen(typetxt), sizeof(typetxt) - strlen(typetxt),
+                 "/%u", s.arg);
+    printf("%s\t%s\t%s\t%u\t%llu\t%.0f\t%.0f\t%.0f\n", timetxt, s.dev,
+           typetxt, s.bytes, (unsigned long long)s.counter,
+           st->ewma.rate[0], st->ewma.rate[1], st->ewma.rate[2]);
+  }
+
+  journal_unmap(&map);
+  g_free(st);
+  return 0;
+}
+
+
+/*
+ * trafficmeter --report: billing period statistics over the journal
+ *
+ * The range is cut into REPORT_CHUNK long chunks that are aggregated in
+ * parallel into REPORT_SLOT long slots. The slots are then merged in time
+ * order into the periods of the report, and a period is written as soon
+ * as all of its chunks are complete. The 95th percentile is taken over the
+ * 5 minute averages, as it is common for burstable billing. The per second
+ * percentiles come from rate histograms of the local hours, which are the
+ * building blocks of every period.
+ */
+
+#define REPORT_SLOT 300
+#define REPORT_CHUNK 86400
+#define REPORT_SPLITS_MAX 64
+#define REPORT_ZONES_MAX 16
+#define REPORT_INFLIGHT_PER_THREAD 4
+#define REPORT_THREADS_MAX 256
+
+typedef enum { REPORT_BY_HOUR
+             , REPORT_BY_DAY
+             , REPORT_BY_MONTH
+             , REPORT_BY_TOTAL
+             } report_by_t;
+
+typedef enum { REPORT_SPLIT_NONE
+             , REPORT_SPLIT_DEV
+             , REPORT_SPLIT_ZONE
+             } report_split_by_t;
+
+typedef struct
+{
+  guint64 bytes;
+  guint32 peak;                   /* highest bytes per second */
+  guint32 seconds;                /* metered seconds */
+} report_slot_t;
+
+typedef struct
+{
+  gint64      hour;               /* start of the local hour */
+  rate_hist_t hist;               /* bytes per second */
+} report_hour_t;
+
+typedef struct
+{
+  char           name[JOURNAL_DEV_LEN];
+  report_slot_t *slots;
+  report_hour_t *hours;           /* in time order */
+  unsigned int   nhours;
+  unsigned int   hours_size;
+  unsigned int   merged;          /* hours already merged */
+} report_split_t;
+
+typedef struct
+{
+  gint64         from;
+  gint64         to;
+  unsigned int   nslots;
+  unsigned int   nsplits;
+  report_split_t splits[REPORT_SPLITS_MAX];
+  gboolean       done;
+} report_chunk_t;
+
+typedef struct
+{
+  char name[JOURNAL_DEV_LEN];
+  int  from;                      /* minutes since local midnight */
+  int  to;                        /* from > to wraps around midnight */
+} report_zone_t;
+
+/* per split accumulator of the current period */
+typedef struct
+{
+  char     name[JOURNAL_DEV_LEN];
+  guint64  bytes;
+  guint64  seconds;
+  guint32  peak;
+  gint64   hour;
+  guint64  hour_bytes;
+  gint64   peak_hour;
+  guint64  peak_hour_bytes;
+  guint64 *rates;                 /* 5 minute averages */
+  unsigned int nrates;
+  unsigned int rates_size;
+  rate_hist_t hist;               /* bytes per second */
+} report_acc_t;
+
+typedef struct
+{
+  journal_map_t     map;
+  gint64            from;
+  gint64            to;
+  report_by_t       by;
+  report_split_by_t split;
+  report_zone_t     zones[REPORT_ZONES_MAX];
+  unsigned int      nzones;
+  gboolean          json;
+  unsigned int      threads;
+
+  report_chunk_t   *chunks;
+  unsigned int      nchunks;
+  GMutex           *mutex;        /* protects done flags of the chunks */
+  GCond            *cond;
+
+  /* merging, done by the main thread only */
+  char              period[32];
+  unsigned int      nrows;
+  unsigned int      nsplits;
+  report_acc_t      acc[REPORT_SPLITS_MAX];
+} report_t;
+
+static void local_tm(gint64 t, struct tm *tm)
+{
+  time_t tt = (time_t)t;
+#ifdef WIN32
+  localtime_s(tm, &tt);
+#else /* !WIN32 */
+  localtime_r(&tt, tm);
+#endif /* !WIN32 */
+}
+
+static void local_day(gint64 t, gint64 *start, gint64 *end)
+{
+  struct tm tm;
+
+  local_tm(t, &tm);
+  tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+  tm.tm_isdst = -1;
+  *start = mktime(&tm);
+  tm.tm_mday += 1;
+  tm.tm_isdst = -1;
+  *end = mktime(&tm);
+}
+
+static const char * report_zone(const report_t *r, int minute)
+{
+  unsigned int i;
+
+  for (i = 0; i < r->nzones; ++i) {
+    const report_zone_t *z = &r->zones[i];
+    if (z->from <= z->to ? (minute >= z->from && minute < z->to)
+                         : (minute >= z->from || minute < z->to))
+      return z->name;
+  }
+  return "other";
+}
+
+static report_split_t * report_chunk_split(report_chunk_t *c, const char *name)
+{
+  unsigned int i;
+
+  for (i = 0; i < c->nsplits; ++i)
+    if (strcmp(c->splits[i].name, name) == 0)
+      return &c->splits[i];
+
+  if (c->nsplits == REPORT_SPLITS_MAX)
+    return &c->splits[REPORT_SPLITS_MAX - 1];
+
+  g_strlcpy(c->splits[i].name, name, sizeof(c->splits[i].name));
+  c->splits[i].slots = (report_slot_t *)g_malloc0(c->nslots * sizeof(report_slot_t));
+  c->splits[i].hours = NULL;
+  c->splits[i].nhours = 0;
+  c->splits[i].hours_size = 0;
+  c->splits[i].merged = 0;
+  ++c->nsplits;
+  return &c->splits[i];
+}
+
+static report_hour_t * report_split_hour(report_split_t *split, gint64 hour)
+{
+  report_hour_t *h;
+
+  if (split->nhours > 0 && split->hours[split->nhours - 1].hour == hour)
+    return &split->hours[split->nhours - 1];
+
+  if (split->nhours == split->hours_size) {
+    split->hours_size = split->hours_size ? 2 * split->hours_size : 4;
+    split->hours = (report_hour_t *)g_realloc(split->hours,
+                                   split->hours_size * sizeof(report_hour_t));
+  }
+  h = &split->hours[split->nhours++];
+  memset(h, 0, sizeof(*h));
+  h->hour = hour;
+  return h;
+}
+
+/* thread pool task: aggregate the samples of one chunk */
+static void report_chunk_run(gpointer data, gpointer user_data)
+{
+  report_chunk_t *c = (report_chunk_t *)data;
+  report_t *r = (report_t *)user_data;
+  report_split_t *split = NULL;
+  journal_iter_t it;
+  journal_sample_t s;
+  gint64 day_start = 0;
+  gint64 day_end = 0;
+  gint64 hour_start = 0;
+  gint64 hour_end = 0;
+
+  journal_iter_init(&it, &r->map, c->from);
+  while (journal_iter_next(&it, &s) && s.time < c->to) {
+    report_slot_t *slot;
+    const char *name;
+
+    if (s.type != JOURNAL_SAMPLE || s.time < c->from)
+      continue;
+
+    switch (r->split) {
+      case REPORT_SPLIT_DEV:
+        name = s.dev;
+        break;
+      case REPORT_SPLIT_ZONE:
+        if (s.time < day_start || s.time >= day_end)
+          local_day(s.time, &day_start, &day_end);
+        name = report_zone(r, (int)((s.time - day_start) / 60));
+        break;
+      default:
+        name = "all";
+        break;
+    }
+    if (split == NULL || strcmp(split->name, name) != 0)
+      split = report_chunk_split(c, name);
+
+    slot = &split->slots[(s.time - c->from) / REPORT_SLOT];
+    slot->bytes += s.bytes;
+    if (s.bytes > slot->peak)
+      slot->peak = s.bytes;
+    ++slot->seconds;
+
+    if (s.time < hour_start || s.time >= hour_end) {
+      struct tm tm;
+      local_tm(s.time, &tm);
+      hour_start = s.time - tm.tm_min * 60 - tm.tm_sec;
+      hour_end = hour_start + 3600;
+    }
+    rate_hist_add(&report_split_hour(split, hour_start)->hist, s.bytes);
+  }
+
+  g_mutex_lock(r->mutex);
+  c->done = TRUE;
+  g_cond_broadcast(r->cond);
+  g_mutex_unlock(r->mutex);
+}
+
+static void report_print_str(const report_t *r, const char *str)
+{
+  if (r->json) {
+    putchar('"');
+    for (; *str; ++str) {
+      if (*str == '"' || *str == '\\')
+        putchar('\\');
+      putchar(*str);
+    }
+    putchar('"');
+  } else if (strpbrk(str, ",\"") != NULL) {
+    putchar('"');
+    for (; *str; ++str) {
+      if (*str == '"')
+        putchar('"');
+      putchar(*str);
+    }
+    putchar('"');
+  } else {
+    fputs(str, stdout);
+  }
+}
+
+static int report_cmp_rate(const void *a, const void *b)
+{
+  guint64 x = *(const guint64 *)a;
+  guint64 y = *(const guint64 *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* write the rows of the current period and restart the accumulators */
+static void report_flush(report_t *r)
+{
+  unsigned int i;
+
+  for (i = 0; i < r->nsplits; ++i) {
+    report_acc_t *a = &r->acc[i];
+    char hourtxt[32] = "";
+    guint64 p95 = 0;
+    guint32 p[3];
+
+    if (a->seconds == 0)
+      continue;
+
+    if (a->hour_bytes > a->peak_hour_bytes) {
+      a->peak_hour_bytes = a->hour_bytes;
+      a->peak_hour = a->hour;
+    }
+    if (a->peak_hour_bytes > 0) {
+      struct tm tm;
+      local_tm(a->peak_hour, &tm);
+      strftime(hourtxt, sizeof(hourtxt), "%Y-%m-%d %H:00", &tm);
+    }
+    if (a->nrates > 0) {
+      qsort(a->rates, a->nrates, sizeof(guint64), report_cmp_rate);
+      p95 = a->rates[(a->nrates * 95 + 99) / 100 - 1];
+    }
+    p[0] = rate_hist_percentile(&a->hist, 50);
+    p[1] = rate_hist_percentile(&a->hist, 95);
+    p[2] = rate_hist_percentile(&a->hist, 99);
+
+    if (r->json) {
+      printf("%s\n  {\"period\": ", r->nrows > 0 ? "," : "");
+      report_print_str(r, r->period);
+      printf(", \"split\": ");
+      report_print_str(r, a->name);
+      printf(", \"bytes\": %llu, \"seconds\": %llu, \"avg_rate\": %llu"
+             ", \"peak_rate\": %u, \"peak_hour\": \"%s\", \"peak_hour_bytes\": %llu"
+             ", \"p95_rate\": %llu, \"p50_second_rate\": %u"
+             ", \"p95_second_rate\": %u, \"p99_second_rate\": %u}",
+             (unsigned long long)a->bytes, (unsigned long long)a->seconds,
+             (unsigned long long)(a->bytes / a->seconds), a->peak, hourtxt,
+             (unsigned long long)a->peak_hour_bytes, (unsigned long long)p95,
+             p[0], p[1], p[2]);
+    } else {
+      report_print_str(r, r->period);
+      putchar(',');
+      report_print_str(r, a->name);
+      printf(",%llu,%llu,%llu,%u,%s,%llu,%llu,%u,%u,%u\n",
+             (unsigned long long)a->bytes, (unsigned long long)a->seconds,
+             (unsigned long long)(a->bytes / a->seconds), a->peak, hourtxt,
+             (unsigned long long)a->peak_hour_bytes, (unsigned long long)p95,
+             p[0], p[1], p[2]);
+    }
+    ++r->nrows;
+
+    a->bytes = 0;
+    a->seconds = 0;
+    a->peak = 0;
+    a->hour = 0;
+    a->hour_bytes = 0;
+    a->peak_hour = 0;
+    a->peak_hour_bytes = 0;
+    a->nrates = 0;
+    memset(&a->hist, 0, sizeof(a->hist));
+  }
+  fflush(stdout);
+}
+
+static report_acc_t * report_acc(report_t *r, const char *name)
+{
+  unsigned int i;
+
+  for (i = 0; i < r->nsplits; ++i)
+    if (strcmp(r->acc[i].name, name) == 0)
+      return &r->acc[i];
+
+  if (r->nsplits == REPORT_SPLITS_MAX)
+    return &r->acc[REPORT_SPLITS_MAX - 1];
+
+  g_strlcpy(r->acc[i].name, name, sizeof(r->acc[i].name));
+  ++r->nsplits;
+  return &r->acc[i];
+}
+
+/* merge a completed chunk, in time order, into the current period */
+static void report_merge(report_t *r, report_chunk_t *c)
+{
+  report_acc_t *acc[REPORT_SPLITS_MAX];
+  unsigned int i;
+  unsigned int k;
+
+  for (k = 0; k < c->nsplits; ++k)
+    acc[k] = report_acc(r, c->splits[k].name);
+
+  for (i = 0; i < c->nslots; ++i) {
+    gint64 t = c->from + (gint64)i * REPORT_SLOT;
+    struct tm tm;
+    char period[sizeof(r->period)];
+    gint64 hour;
+
+    local_tm(t, &tm);
+    switch (r->by) {
+      case REPORT_BY_HOUR:
+        strftime(period, sizeof(period), "%Y-%m-%d %H:00", &tm);
+        break;
+      case REPORT_BY_DAY:
+        strftime(period, sizeof(period), "%Y-%m-%d", &tm);
+        break;
+      case REPORT_BY_MONTH:
+        strftime(period, sizeof(period), "%Y-%m", &tm);
+        break;
+      default:
+        strcpy(period, "total");
+        break;
+    }
+    if (strcmp(period, r->period) != 0) {
+      report_flush(r);
+      strcpy(r->period, period);
+    }
+    hour = t - tm.tm_min * 60 - tm.tm_sec;
+
+    for (k = 0; k < c->nsplits; ++k) {
+      report_split_t *split = &c->splits[k];
+      const report_slot_t *slot = &split->slots[i];
+      report_acc_t *a = acc[k];
+
+      if (slot->seconds == 0)
+        continue;
+
+      /* an hour is merged with its first metered slot, periods are whole hours */
+      if (split->merged < split->nhours && split->hours[split->merged].hour == hour)
+        rate_hist_merge(&a->hist, &split->hours[split->merged++].hist);
+
+      a->bytes += slot->bytes;
+      a->seconds += slot->seconds;
+      if (slot->peak > a->peak)
+        a->peak = slot->peak;
+
+      if (hour != a->hour) {
+        if (a->hour_bytes > a->peak_hour_bytes) {
+          a->peak_hour_bytes = a->hour_bytes;
+          a->peak_hour = a->hour;
+        }
+        a->hour = hour;
+        a->hour_bytes = 0;
+      }
+      a->hour_bytes += slot->bytes;
+
+      if (a->nrates == a->rates_size) {
+        a->rates_size = a->rates_size ? 2 * a->rates_size : 256;
+        a->rates = (guint64 *)g_realloc(a->rates, a->rates_size * sizeof(guint64));
+      }
+      a->rates[a->nrates++] = slot->bytes / REPORT_SLOT;
+    }
+  }
+
+  for (k = 0; k < c->nsplits; ++k) {
+    g_free(c->splits[k].slots);
+    g_free(c->splits[k].hours);
+  }
+  c->nsplits = 0;
+}
+
+/* HH[:MM] as minutes since midnight, up to 24:00 */
+static const char * report_parse_clock(const char *text, int *minutes)
+{
+  char *end;
+  long h, m = 0;
+
+  if (!g_ascii_isdigit(*text))
+    return NULL;
+  h = strtol(text, &end, 10);
+  if (*end == ':') {
+    text = end + 1;
+    if (!g_ascii_isdigit(*text))
+      return NULL;
+    m = strtol(text, &end, 10);
+  }
+  if (h < 0 || h > 24 || m < 0 || m >= 60 || h * 60 + m > 24 * 60)
+    return NULL;
+  *minutes = (int)(h * 60 + m);
+  return end;
+}
+
+static gboolean report_parse_zone(report_t *r, const char *text)
+{
+  const char *eq = strchr(text, '=');
+  const char *p;
+  report_zone_t *z;
+  int from, to;
+  gsize len;
+
+  if (eq == NULL || r->nzones == REPORT_ZONES_MAX)
+    return FALSE;
+  len = eq - text;
+  if (len == 0 || len >= JOURNAL_DEV_LEN)
+    return FALSE;
+  p = report_parse_clock(eq + 1, &from);
+  if (p == NULL || *p != '-')
+    return FALSE;
+  p = report_parse_clock(p + 1, &to);
+  if (p == NULL || *p != '\0')
+    return FALSE;
+
+  z = &r->zones[r->nzones++];
+  memcpy(z->name, text, len);
+  z->name[len] = '\0';
+  z->from = from;
+  z->to = to;
+  return TRUE;
+}
+
+static unsigned int default_threads(void)
+{
+#ifdef WIN32
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return CLAMP(si.dwNumberOfProcessors, 1, REPORT_THREADS_MAX);
+#else /* !WIN32 */
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (unsigned int)MIN(n, REPORT_THREADS_MAX) : 1;
+#endif /* !WIN32 */
+}
+
+static int report_usage(void)
+{
+  fprintf(stderr,
+    "usage: trafficmeter --report [options]\n"
+    "  --from TIME, --to TIME         range, YYYY-MM-DD[ HH:MM[:SS]] or @seconds\n"
+    "  --by hour|day|month|total      period of the rows (default: day)\n"
+    "  --split none|dev|zone          split the rows per interface or zone\n"
+    "  --zone NAME=HH[:MM]-HH[:MM]    define a time of day zone, repeatable\n"
+    "  --format csv|json              output format (default: csv)\n"
+    "  --threads N                    aggregation threads, 1 to %u\n",
+    REPORT_THREADS_MAX);
+  return 2;
+}
+
+static int report_main(int argc, char *argv[])
+{
+  report_t *r = (report_t *)g_malloc0(sizeof(report_t));
+  const journal_block_hdr_t *hdr;
+  GThreadPool *pool;
+  GError *error = NULL;
+  gboolean from_set = FALSE;
+  gboolean to_set = FALSE;
+  unsigned int inflight;
+  unsigned int next = 0;
+  unsigned int i;
+  int ret = 0;
+
+  r->by = REPORT_BY_DAY;
+  r->threads = default_threads();
+
+  for (i = 0; i < (unsigned int)argc; ++i) {
+    const char *opt = argv[i];
+    const char *val = i + 1 < (unsigned int)argc ? argv[i + 1] : NULL;
+
+    if (val == NULL) {
+      ret = report_usage();
+    } else if (strcmp(opt, "--from") == 0) {
+      from_set = parse_time(val, &r->from);
+      if (!from_set) ret = report_usage();
+    } else if (strcmp(opt, "--to") == 0) {
+      to_set = parse_time(val, &r->to);
+      if (!to_set) ret = report_usage();
+    } else if (strcmp(opt, "--by") == 0) {
+      if (strcmp(val, "hour") == 0) r->by = REPORT_BY_HOUR;
+      else if (strcmp(val, "day") == 0) r->by = REPORT_BY_DAY;
+      else if (strcmp(val, "month") == 0) r->by = REPORT_BY_MONTH;
+      else if (strcmp(val, "total") == 0) r->by = REPORT_BY_TOTAL;
+      else ret = report_usage();
+    } else if (strcmp(opt, "--split") == 0) {
+      if (strcmp(val, "none") == 0) r->split = REPORT_SPLIT_NONE;
+      else if (strcmp(val, "dev") == 0) r->split = REPORT_SPLIT_DEV;
+      else if (strcmp(val, "zone") == 0) r->split = REPORT_SPLIT_ZONE;
+      else ret = report_usage();
+    } else if (strcmp(opt, "--zone") == 0) {
+      if (!report_parse_zone(r, val)) ret = report_usage();
+    } else if (strcmp(opt, "--format") == 0) {
+      if (strcmp(val, "csv") == 0) r->json = FALSE;
+      else if (strcmp(val, "json") == 0) r->json = TRUE;
+      else ret = report_usage();
+    } else if (strcmp(opt, "--threads") == 0) {
+      char *end;
+      unsigned long n = strtoul(val, &end, 10);
+      if (   !g_ascii_isdigit(*val) || *end != '\0'
+          || n < 1 || n > REPORT_THREADS_MAX)
+        ret = report_usage();
+      else
+        r->threads = (unsigned int)n;
+    } else {
+      ret = report_usage();
+    }
+    if (ret != 0) {
+      g_free(r);
+      return ret;
+    }
+    ++i;
+  }
+
+  if (!journal_map(JOURNALNAME, &r->map) || r->map.blocks == 0) {
+    fprintf(stderr, "Unable to read %s\n", JOURNALNAME);
+    g_free(r);
+    return 1;
+  }
+
+  for (i = 0; (hdr = journal_block(&r->map, i)) == NULL; ++i)
+    ;
+  if (!from_set || r->from < hdr->base_time)
+    r->from = hdr->base_time;
+  if (!to_set)
+    r->to = time(NULL) + 1;
+  r->from -= r->from % REPORT_SLOT;
+  r->to += (REPORT_SLOT - r->to % REPORT_SLOT) % REPORT_SLOT;
+  if (r->to < r->from)
+    r->to = r->from;
+
+  r->nchunks = (r->to - r->from + REPORT_CHUNK - 1) / REPORT_CHUNK;
+  r->chunks = (report_chunk_t *)g_malloc0(r->nchunks * sizeof(report_chunk_t));
+  for (i = 0; i < r->nchunks; ++i) {
+    report_chunk_t *c = &r->chunks[i];
+    c->from = r->from + (gint64)i * REPORT_CHUNK;
+    c->to = MIN(c->from + REPORT_CHUNK, r->to);
+    c->nslots = (c->to - c->from) / REPORT_SLOT;
+  }
+
+  r->mutex = g_mutex_new();
+  r->cond = g_cond_new();
+  pool = g_thread_pool_new(report_chunk_run, r, r->threads, FALSE, &error);
+  if (pool == NULL) {
+    fprintf(stderr, "Failed to create report threads: %s\n", error->message);
+    g_error_free(error);
+    journal_unmap(&r->map);
+    g_free(r->chunks);
+    g_free(r);
+    return 1;
+  }
+
+  if (r->json)
+    printf("[");
+  else
+    printf("period,split,bytes,seconds,avg_rate,peak_rate,peak_hour,peak_hour_bytes,p95_rate"
+           ",p50_second_rate,p95_second_rate,p99_second_rate\n");
+
+  /* keep a bounded number of chunks in flight, merge them in order */
+  inflight = r->threads * REPORT_INFLIGHT_PER_THREAD;
+  for (i = 0; i < r->nchunks; ++i) {
+    for (; next < r->nchunks && next < i + inflight; ++next)
+      g_thread_pool_push(pool, &r->chunks[next], NULL);
+
+    g_mutex_lock(r->mutex);
+    while (!r->chunks[i].done)
+      g_cond_wait(r->cond, r->mutex);
+    g_mutex_unlock(r->mutex);
+
+    report_merge(r, &r->chunks[i]);
+  }
+  report_flush(r);
+
+  if (r->json)
+    printf("%s]\n", r->nrows > 0 ? "\n" : "");
+
+  g_thread_pool_free(pool, FALSE, TRUE);
+  g_cond_free(r->cond);
+  g_mutex_free(r->mutex);
+  for (i = 0; i < r->nsplits; ++i)
+    g_free(r->acc[i].rates);
+  journal_unmap(&r->map);
+  g_free(r->chunks);
+  g_free(r);
+  return 0;
+}
+
+
+/* Configuration globals */
+typedef enum { UNIT_AUTO
+             , UNIT_BYTE
+             , UNIT_KBYTE
+             , UNIT_MBYTE
+             , UNIT_GBYTE
+             } unit_t;
+unit_t unit = UNIT_AUTO;
+unsigned long long bytes = 0;
+gboolean started = FALSE;
+unsigned long long soft_limit = SOFT_LIMIT;
+unsigned long long hard_limit = HARD_LIMIT;
+static unsigned int bytes_since_last_tmo = 0;
+unsigned int journal_sync = JOURNAL_SYNC_SEC;
+char device_name[DEVICE_NAME_LEN] = "-"; /* "-" if none chosen yet */
+unsigned int device_ifindex = 0;
+char metrics_spec[METRICS_SPEC_LEN] = "none";
+unsigned int proc_accounting = FALSE;
+unsigned int dedup = TRUE;   /* only on the "any" device, see dedup_wanted() */
+unsigned int wireguard_port = WIREGUARD_PORT; /* 0: no WireGuard accounting */
+GMutex* data_mutex = NULL; /* protects configuration globals and other shared data */
+
+
+/*
+ * crash-safe checkpointing
+ *
+ * A background thread appends the counter increments to a small write-ahead
+ * log every checkpoint_interval seconds, and regularly writes a complete rc
+ * snapshot (temporary file renamed over the old one) after which the log is
+ * truncated. Log records carry the generation of the snapshot they continue,
+ * so on startup the counter is the snapshot value plus the increments of
+ * the matching generation. The capture and GUI threads only take
+ * data_mutex for a copy of the counters, they never wait for the disk.
+ */
+
+#define WALNAME ".trafficmeterwal"
+#define CHECKPOINT_SEC 5          /* default interval of the log appends */
+#define CHECKPOINT_WAL_MAX 120    /* log records before a new snapshot */
+#define CHECKPOINT_WAL_MAGIC 0x544d574cu
+
+typedef enum { CHECKPOINT_SYNC_NONE       /* leave it to the OS */
+             , CHECKPOINT_SYNC_SNAPSHOT   /* fsync the snapshots only */
+             , CHECKPOINT_SYNC_ALL        /* fsync every log append, too */
+             } checkpoint_sync_t;
+
+unsigned int checkpoint_interval = CHECKPOINT_SEC;
+unsigned int checkpoint_sync = CHECKPOINT_SYNC_ALL;
+guint32 rc_generation = 0;
+
+typedef struct
+{
+  guint32 generation;
+  guint32 check;
+  guint64 delta;
+} checkpoint_rec_t;
+
+typedef struct
+{
+  GMutex       *mutex;            /* protects quit and dirty */
+  GCond        *cond;
+  GThread      *thread;
+  gboolean      quit;
+  gboolean      dirty;            /* settings changed, snapshot needed */
+  FILE         *wal;
+  guint32       generation;
+  unsigned long long saved;       /* counter value in the snapshot + log */
+  unsigned int  wal_recs;
+} checkpoint_t;
+static checkpoint_t *checkpoint = NULL;
+
+static guint32 checkpoint_check(guint32 generation, guint64 delta)
+{
+  return (generation * 2654435761u) ^ (guint32)delta ^ (guint32)(delta >> 32)
+         ^ CHECKPOINT_WAL_MAGIC;
+}
+
+static void quota_write(FILE *f);
+
+/* write the rc file with the given generation, returns the saved counter */
+static gboolean rc_save(guint32 generation, gboolean sync,
+                        unsigned long long *saved)
+{
+  unsigned long long b, soft, hard;
+  unsigned int u, jsync, cint, csync, procs, dd, ifx, wg;
+  char name[DEVICE_NAME_LEN];
+  gboolean ok;
+  FILE *f;
+
+  if (data_mutex) g_mutex_lock (data_mutex);
+  b = bytes;
+  u = unit;
+  g_strlcpy (name, device_name, sizeof(name));
+  ifx = device_ifindex;
+  soft = soft_limit;
+  hard = hard_limit;
+  jsync = journal_sync;
+  cint = checkpoint_interval;
+  csync = checkpoint_sync;
+  procs = proc_accounting;
+  dd = dedup;
+  wg = wireguard_port;
+  if (data_mutex) g_mutex_unlock (data_mutex);
+
+  f = fopen (RCNAME ".tmp", "w");
+  if (f == NULL)
+    return FALSE;
+  fprintf (f, "bytes=%llu\n", b);
+  fprintf (f, "unit=%u\n", u);
+  fprintf (f, "device=%s\n", name);
+  fprintf (f, "ifindex=%u\n", ifx);
+  fprintf (f, "softlimit=%llu\n", soft);
+  fprintf (f, "hardlimit=%llu\n", hard);
+  fprintf (f, "journalsync=%u\n", jsync);
+  fprintf (f, "checkpoint=%u\n", cint);
+  fprintf (f, "checkpointsync=%u\n", csync);
+  fprintf (f, "generation=%u\n", generation);
+  fprintf (f, "metrics=%s\n", metrics_spec);
+  fprintf (f, "processes=%u\n", procs);
+  fprintf (f, "dedup=%u\n", dd);
+  fprintf (f, "wireguardport=%u\n", wg);
+  quota_write (f);
+  ok = fflush (f) == 0 && (!sync || fsync (fileno (f)) == 0);
+  ok = fclose (f) == 0 && ok;
+  ok = ok && rename_replace (RCNAME ".tmp", RCNAME) == 0;
+  if (ok && saved != NULL)
+    *saved = b;
+  return ok;
+}
+
+/* add the increments logged after the last snapshot to bytes */
+static void checkpoint_recover(void)
+{
+  checkpoint_rec_t rec;
+  unsigned long long delta = 0;
+  unsigned int n = 0;
+  FILE *f = fopen (WALNAME, "rb");
+
+  if (f == NULL)
+    return;
+  while (fread (&rec, sizeof(rec), 1, f) == 1) {
+    if (   rec.generation == rc_generation
+        && rec.check == checkpoint_check (rec.generation, rec.delta)) {
+      delta += rec.delta;
+      ++n;
+    }
+  }
+  fclose (f);
+
+  if (n > 0) {
+    g_print ("recovered %llu bytes from %u log records\n", delta, n);
+    bytes += delta;
+  }
+}
+
+static gboolean checkpoint_snapshot(checkpoint_t *cp, gboolean sync)
+{
+  if (!rc_save (cp->generation + 1, sync, &cp->saved))
+    return FALSE;
+  ++cp->generation;
+  cp->wal_recs = 0;
+  if (cp->wal != NULL) {
+    fflush (cp->wal);
+    if (ftruncate (fileno (cp->wal), 0) != 0)
+      g_printerr ("checkpoint: unable to truncate %s\n", WALNAME);
+  }
+  return TRUE;
+}
+
+static void checkpoint_run(checkpoint_t *cp)
+{
+  unsigned long long b;
+  gboolean dirty;
+
+  g_mutex_lock (data_mutex);
+  b = bytes;
+  g_mutex_unlock (data_mutex);
+
+  g_mutex_lock (cp->mutex);
+  dirty = cp->dirty;
+  cp->dirty = FALSE;
+  g_mutex_unlock (cp->mutex);
+
+  /* a reset cannot be logged as increment, it needs a snapshot, too */
+  if (dirty || b < cp->saved || cp->wal_recs >= CHECKPOINT_WAL_MAX || cp->wal == NULL) {
+    if (!checkpoint_snapshot (cp, checkpoint_sync != CHECKPOINT_SYNC_NONE))
+      g_printerr ("checkpoint: unable to write %s\n", RCNAME);
+  } else if (b > cp->saved) {
+    checkpoint_rec_t rec;
+    rec.generation = cp->generation;
+    rec.delta = b - cp->saved;
+    rec.check = checkpoint_check (rec.generation, rec.delta);
+    if (   fwrite (&rec, sizeof(rec), 1, cp->wal) != 1
+        || fflush (cp->wal) != 0
+        || (checkpoint_sync == CHECKPOINT_SYNC_ALL && fsync (fileno (cp->wal)) != 0)) {
+      /* the record may be torn, start over with a snapshot */
+      clearerr (cp->wal);
+      cp->wal_recs = CHECKPOINT_WAL_MAX;
+    } else {
+      cp->saved = b;
+      ++cp->wal_recs;
+    }
+  }
+}
+
+static gpointer checkpoint_thread(gpointer data)
+{
+  checkpoint_t *cp = (checkpoint_t *)data;
+
+  g_mutex_lock (cp->mutex);
+  while (!cp->quit) {
+    GTimeVal until;
+
+    g_mutex_unlock (cp->mutex);
+    checkpoint_run (cp);
+    g_mutex_lock (cp->mutex);
+
+    g_get_current_time (&until);
+    g_time_val_add (&until, (glong)MAX(checkpoint_interval, 1) * G_USEC_PER_SEC);
+    while (!cp->quit && !cp->dirty)
+      if (!g_cond_timed_wait (cp->cond, cp->mutex, &until))
+        break;
+  }
+  g_mutex_unlock (cp->mutex);
+  return NULL;
+}
+
+/* call after data_mutex exists and the recovered counter is in bytes */
+static checkpoint_t * checkpoint_open(void)
+{
+  GError *error = NULL;
+  checkpoint_t *cp = (checkpoint_t *)g_malloc0(sizeof(checkpoint_t));
+
+  cp->mutex = g_mutex_new ();
+  cp->cond = g_cond_new ();
+  cp->generation = rc_generation;
+  cp->dirty = TRUE; /* fold the recovered log into a new snapshot first */
+  cp->wal = fopen (WALNAME, "ab");
+  if (cp->wal == NULL)
+    g_print ("%s cannot be opened, only snapshots are written\n", WALNAME);
+
+  cp->thread = g_thread_create (&checkpoint_thread, cp, TRUE, &error);
+  if (cp->thread == NULL) {
+    g_printerr ("Failed to create checkpoint thread: %s\n", error->message);
+    g_error_free (error);
+    if (cp->wal != NULL)
+      fclose (cp->wal);
+    g_cond_free (cp->cond);
+    g_mutex_free (cp->mutex);
+    g_free (cp);
+    return NULL;
+  }
+  return cp;
+}
+
+/* request a snapshot, e.g. after a settings change or counter reset */
+static void checkpoint_request(checkpoint_t *cp)
+{
+  if (cp == NULL)
+    return;
+  g_mutex_lock (cp->mutex);
+  cp->dirty = TRUE;
+  g_cond_signal (cp->cond);
+  g_mutex_unlock (cp->mutex);
+}
+
+/* stop the thread and write the final snapshot, works without thread, too */
+static gboolean checkpoint_close(checkpoint_t *cp)
+{
+  gboolean ok;
+
+  if (cp == NULL)
+    return rc_save (rc_generation + 1, TRUE, NULL);
+
+  g_mutex_lock (cp->mutex);
+  cp->quit = TRUE;
+  g_cond_signal (cp->cond);
+  g_mutex_unlock (cp->mutex);
+  g_thread_join (cp->thread);
+
+  ok = checkpoint_snapshot (cp, TRUE);
+  rc_generation = cp->generation;
+  if (cp->wal != NULL)
+    fclose (cp->wal);
+  g_cond_free (cp->cond);
+  g_mutex_free (cp->mutex);
+  g_free (cp);
+  return ok;
+}
+
+
+/*
+ * wakeup accounting
+ *
+ * The timer ticks, the returns of the counter thread from waiting and the
+ * graph redraws are counted, and once a second the counts of the last
+ * minute and the CPU time of the process are published, to check that the
+ * meter stays quiet on a quiet machine.
+ */
+
+#define WAKEUP_RING 60
+
+typedef struct
+{
+  guint32 seen[TM_SHM_WAKEUPS];   /* counters at the last tick */
+  guint64 ring[WAKEUP_RING][TM_SHM_WAKEUPS]; /* totals of the last ticks */
+  unsigned int pos;
+} wakeup_t;
+
+static volatile gint wakeups[TM_SHM_WAKEUPS];   /* atomic, may wrap */
+static wakeup_t wakeup;                         /* timer_handler only */
+static tm_shm_power_t power;                    /* protected by data_mutex */
+
+static void wakeup_count(int source)
+{
+  g_atomic_int_inc(&wakeups[source]);
+}
+
+static guint64 cpu_usec(void)
+{
+#ifdef WIN32
+  FILETIME created, exited, kernel, user;
+  ULARGE_INTEGER k, u;
+
+  if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+    return 0;
+  k.LowPart = kernel.dwLowDateTime;
+  k.HighPart = kernel.dwHighDateTime;
+  u.LowPart = user.dwLowDateTime;
+  u.HighPart = user.dwHighDateTime;
+  return (k.QuadPart + u.QuadPart) / 10;
+#else /* !WIN32 */
+  struct rusage ru;
+
+  if (getrusage(RUSAGE_SELF, &ru) != 0)
+    return 0;
+  return (guint64)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * G_USEC_PER_SEC
+         + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#endif /* !WIN32 */
+}
+
+/* once a second, with data_mutex held */
+static void wakeup_tick(void)
+{
+  guint64 *oldest = wakeup.ring[wakeup.pos];
+  int i;
+
+  for (i = 0; i < TM_SHM_WAKEUPS; ++i) {
+    guint32 n = (guint32)g_atomic_int_get(&wakeups[i]);
+    power.wakeups[i] += n - wakeup.seen[i];
+    wakeup.seen[i] = n;
+    power.per_minute[i] = (guint32)(power.wakeups[i] - oldest[i]);
+    oldest[i] = power.wakeups[i];
+  }
+  wakeup.pos = (wakeup.pos + 1) % WAKEUP_RING;
+  power.cpu_usec = cpu_usec();
+}
+
+
+/*
+ * shared memory export of the counters, see trafficmeter_shm.h
+ *
+ * Every writer holds data_mutex, so the sequence lock has a single writer
+ * and the capture path only pays for two atomic increments per packet.
+ */
+
+static tm_shm_t *shm = NULL;
+
+static tm_shm_t * shm_create(void)
+{
+  tm_shm_t *s;
+#ifdef WIN32
+  HANDLE h = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                0, sizeof(tm_shm_t), TM_SHM_NAME);
+  if (h == NULL)
+    return NULL;
+  /* the mapping lives as long as the process, the handle is not closed */
+  s = (tm_shm_t *)MapViewOfFile(h, FILE_MAP_WRITE, 0, 0, sizeof(tm_shm_t));
+  if (s == NULL)
+    return NULL;
+#else /* !WIN32 */
+  void *seg;
+  int fd = shm_open(TM_SHM_NAME, O_CREAT | O_RDWR, 0644);
+
+  if (fd < 0)
+    return NULL;
+  if (ftruncate(fd, sizeof(tm_shm_t)) != 0) {
+    close(fd);
+    return NULL;
+  }
+  seg = mmap(NULL, sizeof(tm_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (seg == MAP_FAILED)
+    return NULL;
+  s = (tm_shm_t *)seg;
+#endif /* !WIN32 */
+
+  /* a segment left behind by a crash is reinitialised, magic comes last */
+  s->magic = 0;
+  memset((char *)s + sizeof(s->magic), 0, sizeof(tm_shm_t) - sizeof(s->magic));
+  s->version = TM_SHM_VERSION;
+  s->size = sizeof(tm_shm_t);
+#ifdef WIN32
+  s->pid = GetCurrentProcessId();
+#else /* !WIN32 */
+  s->pid = getpid();
+#endif /* !WIN32 */
+  s->niface = 1;
+  g_atomic_int_set(&s->seq, 0);
+  s->magic = TM_SHM_MAGIC;
+  return s;
+}
+
+static void shm_destroy(tm_shm_t *s)
+{
+  if (s == NULL)
+    return;
+#ifdef WIN32
+  UnmapViewOfFile(s);
+#else /* !WIN32 */
+  munmap(s, sizeof(tm_shm_t));
+  shm_unlink(TM_SHM_NAME);
+#endif /* !WIN32 */
+}
+
+static void shm_begin(tm_shm_t *s)
+{
+  g_atomic_int_inc(&s->seq);
+}
+
+static void shm_end(tm_shm_t *s)
+{
+  g_atomic_int_inc(&s->seq);
+}
+
+static guint32 limit_state(void)
+{
+  if (bytes > hard_limit)
+    return TM_SHM_LIMIT_HARD;
+  if (bytes > soft_limit)
+    return TM_SHM_LIMIT_SOFT;
+  return TM_SHM_LIMIT_OK;
+}
+
+/* the functions below expect data_mutex to be held */
+
+static void shm_publish(void)
+{
+  if (shm == NULL)
+    return;
+  shm_begin(shm);
+  shm->counter = bytes;
+  shm->soft_limit = soft_limit;
+  shm->hard_limit = hard_limit;
+  shm->limit_state = limit_state();
+  shm->started = started;
+  shm->updated = (gint64)time(NULL) * G_USEC_PER_SEC;
+  shm_end(shm);
+}
+
+static void shm_set_iface(const char *name, gboolean active)
+{
+  if (shm == NULL)
+    return;
+  shm_begin(shm);
+  if (name != NULL && strcmp(shm->iface[0].name, name) != 0) {
+    memset(&shm->iface[0], 0, sizeof(shm->iface[0]));
+    g_strlcpy(shm->iface[0].name, name, sizeof(shm->iface[0].name));
+  }
+  shm->iface[0].active = active;
+  shm_end(shm);
+}
+
+static const char *tunnel_type_name[] =
+  { "none", "vlan", "gre", "vxlan", "geneve", "esp", "wireguard", "other" };
+static const char *quota_kind_name[] = { "counter", "rolling", "day", "month" };
+static const char *quota_state_name[] = { "ok", "soft", "hard" };
+
+/* names of values read from the segment, which may come from another writer */
+static const char * tunnel_type_text(guint32 type)
+{
+  return tunnel_type_name[type < G_N_ELEMENTS(tunnel_type_name) ? type : 0];
+}
+
+static const char * quota_kind_text(guint32 kind)
+{
+  return quota_kind_name[kind < G_N_ELEMENTS(quota_kind_name) ? kind : 0];
+}
+
+static void tunnel_id_text(const tm_shm_tunnel_t *t, char *text, gsize size)
+{
+  if (t->type == TM_SHM_TUNNEL_VLAN && t->id > 0x0fff)
+    g_snprintf(text, size, "%u.%u", t->id >> 12, t->id & 0x0fff);
+  else if (t->type == TM_SHM_TUNNEL_ESP)
+    g_snprintf(text, size, "0x%08x", t->id);
+  else if (t->type == TM_SHM_TUNNEL_OTHER)
+    g_strlcpy(text, "", size);
+  else
+    g_snprintf(text, size, "%u", t->id);
+}
+
+/* adds a packet to a table of TM_SHM_TUNNELS entries in order of
+   appearance, the last entry takes all tunnels that do not fit */
+static void tunnel_count(tm_shm_tunnel_t *t, guint32 *n, guint32 type,
+                         guint32 id, unsigned int len, guint32 inner_len)
+{
+  guint32 i;
+
+  for (i = 0; i < *n; ++i)
+    if (t[i].type == type && t[i].id == id)
+      break;
+  if (i == *n) {
+    if (*n == TM_SHM_TUNNELS) {
+      i = TM_SHM_TUNNELS - 1;
+    } else {
+      if (*n == TM_SHM_TUNNELS - 1) {
+        type = TM_SHM_TUNNEL_OTHER;
+        id = 0;
+      }
+      t[i].type = type;
+      t[i].id = id;
+      ++*n;
+    }
+  }
+  ++t[i].packets;
+  t[i].outer_bytes += len;
+  t[i].inner_bytes += inner_len;
+}
+
+static void shm_count_packet(int dir, unsigned int len, const struct timeval *ts,
+                             guint32 tunnel, guint32 tunnel_id, guint32 inner_len)
+{
+  if (shm == NULL)
+    return;
+  shm_begin(shm);
+  if (tunnel != TM_SHM_TUNNEL_NONE)
+    tunnel_count(shm->tunnel, &shm->ntunnel, tunnel, tunnel_id, len, inner_len);
+  shm->iface[0].bytes[dir] += len;
+  ++shm->iface[0].packets[dir];
+  shm->counter = bytes;
+  shm->updated = (gint64)ts->tv_sec * G_USEC_PER_SEC + ts->tv_usec;
+  shm_end(shm);
+}
+
+static void shm_count_dup(unsigned int len)
+{
+  if (shm == NULL)
+    return;
+  shm_begin(shm);
+  shm->iface[0].dup_bytes += len;
+  ++shm->iface[0].dup_packets;
+  shm_end(shm);
+}
+
+static void shm_set_drops(const struct pcap_stat *ps)
+{
+  if (shm == NULL)
+    return;
+  shm_begin(shm);
+  shm->iface[0].drops = ps->ps_drop;
+  shm->iface[0].ifdrops = ps->ps_ifdrop;
+  shm_end(shm);
+}
+
+static void shm_push_second(guint32 b)
+{
+  if (shm == NULL)
+    return;
+  shm_begin(shm);
+  shm->history_head = (shm->history_head + 1) % TM_SHM_HISTORY;
+  shm->history[shm->history_head] = b;
+  if (shm->history_len < TM_SHM_HISTORY)
+    ++shm->history_len;
+  shm->history_time = time(NULL);
+  shm->iface[0].rate = b;
+  shm_end(shm);
+}
+
+static void shm_clear_history(void)
+{
+  if (shm == NULL)
+    return;
+  shm_begin(shm);
+  shm->history_len = 0;
+  shm->history_head = 0;
+  memset(shm->history, 0, sizeof(shm->history));
+  shm->iface[0].rate = 0;
+  shm_end(shm);
+}
+
+static void shm_push_stats(const rate_stats_t *st)
+{
+  int i;
+
+  if (shm == NULL)
+    return;
+  shm_begin(shm);
+  shm->stats.seconds = st->seconds;
+  shm->stats.bytes = st->bytes;
+  for (i = 0; i < RATE_EWMAS; ++i)
+    shm->stats.ewma[i] = st->ewma.rate[i];
+  shm->stats.p50 = rate_hist_percentile(&st->hist, 50);
+  shm->stats.p95 = rate_hist_percentile(&st->hist, 95);
+  shm->stats.p99 = rate_hist_percentile(&st->hist, 99);
+  memcpy(shm->stats.sizes, st->sizes, sizeof(shm->stats.sizes));
+  shm->stats.size_sum = st->size_sum;
+  shm_end(shm);
+}
+
+static void shm_push_power(void)
+{
+  if (shm == NULL)
+    return;
+  shm_begin(shm);
+  shm->power = power;
+  shm_end(shm);
+}
+
+/* trafficmeter --watch [INTERVAL_MS [COUNT]]: sample a running trafficmeter */
+static int shm_watch(int argc, char *argv[])
+{
+  static const char *state_name[] = { "ok", "soft", "hard" };
+  tm_shm_reader_t r;
+  tm_shm_t snap;
+  unsigned long interval = argc > 0 ? strtoul(argv[0], NULL, 10) : 1000;
+  unsigned long count = argc > 1 ? strtoul(argv[1], NULL, 10) : 0;
+  unsigned long n;
+
+  if (!tm_shm_open(&r)) {
+    fprintf(stderr, "No running trafficmeter found (%s)\n", TM_SHM_NAME);
+    return 1;
+  }
+
+  for (n = 0; count == 0 || n < count; ++n) {
+    unsigned int i;
+
+    if (n > 0)
+      g_usleep(interval * 1000);
+    if (!tm_shm_snapshot(&r, &snap)) {
+      fprintf(stderr, "No consistent snapshot, writer too busy\n");
+      continue;
+    }
+
+    printf("%lld.%06lld counter=%llu state=%s",
+           (long long)(snap.updated / G_USEC_PER_SEC),
+           (long long)(snap.updated % G_USEC_PER_SEC),
+           (unsigned long long)snap.counter,
+           state_name[snap.limit_state < 3 ? snap.limit_state : 0]);
+    for (i = 0; i < snap.niface && i < TM_SHM_IFACES; ++i) {
+      const tm_shm_iface_t *f = &snap.iface[i];
+      if (f->name[0] == '\0')
+        continue;
+      printf(" %.*s%s in=%llu/%llu out=%llu/%llu dup=%llu/%llu rate=%u",
+             (int)sizeof(f->name), f->name, f->active ? "" : "(stopped)",
+             (unsigned long long)f->bytes[TM_SHM_IN],
+             (unsigned long long)f->packets[TM_SHM_IN],
+             (unsigned long long)f->bytes[TM_SHM_OUT],
+             (unsigned long long)f->packets[TM_SHM_OUT],
+             (unsigned long long)f->dup_bytes,
+             (unsigned long long)f->dup_packets, f->rate);
+    }
+    printf(" ewma=%.0f/%.0f/%.0f p50=%u p95=%u p99=%u",
+           snap.stats.ewma[0], snap.stats.ewma[1], snap.stats.ewma[2],
+           snap.stats.p50, snap.stats.p95, snap.stats.p99);
+    printf(" wakeups/min=%u/%u/%u cpu=%.2fs",
+           snap.power.per_minute[TM_SHM_WAKEUP_TIMER],
+           snap.power.per_minute[TM_SHM_WAKEUP_CAPTURE],
+           snap.power.per_minute[TM_SHM_WAKEUP_REDRAW],
+           snap.power.cpu_usec / 1e6);
+    for (i = 1; i < snap.nquota && i < TM_SHM_QUOTAS; ++i) {
+      const tm_shm_quota_t *q = &snap.quota[i];
+      printf(" %s=%llu(%s)",
+             quota_kind_text(q->kind),
+             (unsigned long long)q->usage,
+             state_name[q->state < 3 ? q->state : 0]);
+    }
+    for (i = 0; i < snap.ntunnel && i < TM_SHM_TUNNELS; ++i) {
+      const tm_shm_tunnel_t *t = &snap.tunnel[i];
+      char id[16];
+      tunnel_id_text(t, id, sizeof(id));
+      printf(" %s:%s=%llu/%llu",
+             tunnel_type_text(t->type),
+             id, (unsigned long long)t->outer_bytes,
+             (unsigned long long)t->inner_bytes);
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+
+  tm_shm_close(&r);
+  return 0;
+}
+
+
+/*
+ * metrics endpoint: Prometheus text format over HTTP on a Unix domain
+ * socket or a loopback TCP port, e.g. in the rc file
+ *
+ *   metrics=tcp:9464          curl http://127.0.0.1:9464/metrics
+ *   metrics=unix:/tmp/tm.sock curl --unix-socket /tmp/tm.sock http://tm/metrics
+ *
+ * The sockets are non-blocking and served from the main loop. Responses are
+ * built in preallocated per connection buffers from a seqlock snapshot of
+ * the shared memory segment, so a scrape never takes data_mutex.
+ */
+
+#define METRICS_CONN_MAX 8
+#define METRICS_REQ_SIZE 1024
+#define METRICS_HEAD_MAX 160
+#define METRICS_RESP_SIZE 32768
+
+#ifndef WIN32
+
+typedef struct
+{
+  int          fd;                /* -1 if the slot is free */
+  GIOChannel  *channel;
+  guint        watch;
+  gint64       since;
+  gsize        req_len;
+  const char  *out;
+  gsize        out_len;
+  char         req[METRICS_REQ_SIZE];
+  char         resp[METRICS_HEAD_MAX + METRICS_RESP_SIZE];
+} metrics_conn_t;
+
+typedef struct
+{
+  int             fd;
+  GIOChannel     *channel;
+  guint           watch;
+  char            path[METRICS_SPEC_LEN];  /* unix socket to unlink */
+  metrics_conn_t  conn[METRICS_CONN_MAX];
+  tm_shm_t        snap;
+} metrics_t;
+static metrics_t *metrics = NULL;
+
+static void metrics_conn_close(metrics_conn_t *c)
+{
+  if (c->fd < 0)
+    return;
+  if (c->watch != 0)
+    g_source_remove(c->watch);
+  g_io_channel_unref(c->channel);
+  close(c->fd);
+  c->fd = -1;
+}
+
+/* close from the connection's own watch, which is removed by returning FALSE */
+static gboolean metrics_conn_done(metrics_conn_t *c)
+{
+  c->watch = 0;
+  metrics_conn_close(c);
+  return FALSE;
+}
+
+/* appends to the body, output beyond the buffer is cut */
+static void metrics_add(char *body, gsize *len, const char *fmt, ...)
+{
+  va_list ap;
+  int n;
+
+  if (*len >= METRICS_RESP_SIZE)
+    return;
+  va_start(ap, fmt);
+  n = vsnprintf(body + *len, METRICS_RESP_SIZE - *len, fmt, ap);
+  va_end(ap);
+  if (n > 0)
+    *len = MIN(*len + n, METRICS_RESP_SIZE);
+}
+
+static void metrics_label(char *out, gsize size, const char *name, gsize max)
+{
+  gsize i, n = 0;
+
+  for (i = 0; i < max && name[i] != '\0' && n + 2 < size; ++i) {
+    if (name[i] == '"' || name[i] == '\\')
+      out[n++] = '\\';
+    out[n++] = name[i];
+  }
+  out[n] = '\0';
+}
+
+static gsize metrics_body(metrics_t *m, char *body)
+{
+  const tm_shm_t *s = &m->snap;
+  char names[TM_SHM_IFACES][2 * sizeof(s->iface[0].name) + 1];
+  unsigned long long sum = 0, max = 0, sizes = 0;
+  gsize len = 0;
+  unsigned int i;
+
+  metrics_add(body, &len,
+    "# HELP trafficmeter_counter_bytes Bytes counted since the last reset.\n"
+    "# TYPE trafficmeter_counter_bytes gauge\n"
+    "trafficmeter_counter_bytes %llu\n"
+    "# HELP trafficmeter_limit_bytes Configured soft and hard limits.\n"
+    "# TYPE trafficmeter_limit_bytes gauge\n"
+    "trafficmeter_limit_bytes{limit=\"soft\"} %llu\n"
+    "trafficmeter_limit_bytes{limit=\"hard\"} %llu\n"
+    "# HELP trafficmeter_limit_state 0: below the limits, 1: above soft, 2: above hard.\n"
+    "# TYPE trafficmeter_limit_state gauge\n"
+    "trafficmeter_limit_state %u\n"
+    "# HELP trafficmeter_started 1 while counting.\n"
+    "# TYPE trafficmeter_started gauge\n"
+    "trafficmeter_started %u\n"
+    "# HELP trafficmeter_last_update_timestamp_seconds Time of the last counter update.\n"
+    "# TYPE trafficmeter_last_update_timestamp_seconds gauge\n"
+    "trafficmeter_last_update_timestamp_seconds %lld.%06lld\n",
+    (unsigned long long)s->counter, (unsigned long long)s->soft_limit,
+    (unsigned long long)s->hard_limit, s->limit_state, s->started,
+    (long long)(s->updated / G_USEC_PER_SEC),
+    (long long)(s->updated % G_USEC_PER_SEC));
+
+  /* the samples of a family must form one group, so each family has its
+     own loop over the interfaces */
+  for (i = 0; i < s->niface && i < TM_SHM_IFACES; ++i)
+    metrics_label(names[i], sizeof(names[i]), s->iface[i].name,
+                  sizeof(s->iface[i].name));
+
+  metrics_add(body, &len,
+    "# HELP trafficmeter_bytes_total Bytes captured per interface and direction.\n"
+    "# TYPE trafficmeter_bytes_total counter\n");
+  for (i = 0; i < s->niface && i < TM_SHM_IFACES; ++i)
+    if (names[i][0] != '\0')
+      metrics_add(body, &len,
+        "trafficmeter_bytes_total{interface=\"%s\",direction=\"in\"} %llu\n"
+        "trafficmeter_bytes_total{interface=\"%s\",direction=\"out\"} %llu\n",
+        names[i], (unsigned long long)s->iface[i].bytes[TM_SHM_IN],
+        names[i], (unsigned long long)s->iface[i].bytes[TM_SHM_OUT]);
+
+  metrics_add(body, &len,
+    "# HELP trafficmeter_packets_total Packets captured per interface and direction.\n"
+    "# TYPE trafficmeter_packets_total counter\n");
+  for (i = 0; i < s->niface && i < TM_SHM_IFACES; ++i)
+    if (names[i][0] != '\0')
+      metrics_add(body, &len,
+        "trafficmeter_packets_total{interface=\"%s\",direction=\"in\"} %llu\n"
+        "trafficmeter_packets_total{interface=\"%s\",direction=\"out\"} %llu\n",
+        names[i], (unsigned long long)s->iface[i].packets[TM_SHM_IN],
+        names[i], (unsigned long long)s->iface[i].packets[TM_SHM_OUT]);
+
+  metrics_add(body, &len,
+    "# HELP trafficmeter_rate_bytes_per_second Bytes in the last completed second.\n"
+    "# TYPE trafficmeter_rate_bytes_per_second gauge\n");
+  for (i = 0; i < s->niface && i < TM_SHM_IFACES; ++i)
+    if (names[i][0] != '\0')
+      metrics_add(body, &len,
+        "trafficmeter_rate_bytes_per_second{interface=\"%s\"} %u\n",
+        names[i], s->iface[i].rate);
+
+  metrics_add(body, &len,
+    "# HELP trafficmeter_pcap_dropped_packets_total Packets dropped by the kernel and the interface, as reported by pcap.\n"
+    "# TYPE trafficmeter_pcap_dropped_packets_total counter\n");
+  for (i = 0; i < s->niface && i < TM_SHM_IFACES; ++i)
+    if (names[i][0] != '\0')
+      metrics_add(body, &len,
+        "trafficmeter_pcap_dropped_packets_total{interface=\"%s\",where=\"kernel\"} %llu\n"
+        "trafficmeter_pcap_dropped_packets_total{interface=\"%s\",where=\"interface\"} %llu\n",
+        names[i], (unsigned long long)s->iface[i].drops,
+        names[i], (unsigned long long)s->iface[i].ifdrops);
+
+  metrics_add(body, &len,
+    "# HELP trafficmeter_duplicate_bytes_total Bytes not counted as duplicates of packets seen on another interface.\n"
+    "# TYPE trafficmeter_duplicate_bytes_total counter\n");
+  for (i = 0; i < s->niface && i < TM_SHM_IFACES; ++i)
+    if (names[i][0] != '\0')
+      metrics_add(body, &len,
+        "trafficmeter_duplicate_bytes_total{interface=\"%s\"} %llu\n",
+        names[i], (unsigned long long)s->iface[i].dup_bytes);
+
+  metrics_add(body, &len,
+    "# HELP trafficmeter_duplicate_packets_total Packets not counted as duplicates of packets seen on another interface.\n"
+    "# TYPE trafficmeter_duplicate_packets_total counter\n");
+  for (i = 0; i < s->niface && i < TM_SHM_IFACES; ++i)
+    if (names[i][0] != '\0')
+      metrics_add(body, &len,
+        "trafficmeter_duplicate_packets_total{interface=\"%s\"} %llu\n",
+        names[i], (unsigned long long)s->iface[i].dup_packets);
+
+  metrics_add(body, &len,
+    "# HELP trafficmeter_quota_usage_bytes Bytes in the quota windows, window 0 is the counter.\n"
+    "# TYPE trafficmeter_quota_usage_bytes gauge\n");
+  for (i = 0; i < s->nquota && i < TM_SHM_QUOTAS; ++i)
+    metrics_add(body, &len,
+      "trafficmeter_quota_usage_bytes{window=\"%u\",kind=\"%s\"} %llu\n",
+      i, quota_kind_text(s->quota[i].kind), (unsigned long long)s->quota[i].usage);
+
+  metrics_add(body, &len,
+    "# HELP trafficmeter_quota_limit_bytes Soft and hard limits of the quota windows.\n"
+    "# TYPE trafficmeter_quota_limit_bytes gauge\n");
+  for (i = 0; i < s->nquota && i < TM_SHM_QUOTAS; ++i)
+    metrics_add(body, &len,
+      "trafficmeter_quota_limit_bytes{window=\"%u\",kind=\"%s\",limit=\"soft\"} %llu\n"
+      "trafficmeter_quota_limit_bytes{window=\"%u\",kind=\"%s\",limit=\"hard\"} %llu\n",
+      i, quota_kind_text(s->quota[i].kind), (unsigned long long)s->quota[i].soft_limit,
+      i, quota_kind_text(s->quota[i].kind), (unsigned long long)s->quota[i].hard_limit);
+
+  metrics_add(body, &len,
+    "# HELP trafficmeter_quota_state 0: below the limits, 1: above soft, 2: above hard.\n"
+    "# TYPE trafficmeter_quota_state gauge\n");
+  for (i = 0; i < s->nquota && i < TM_SHM_QUOTAS; ++i)
+    metrics_add(body, &len,
+      "trafficmeter_quota_state{window=\"%u\",kind=\"%s\"} %u\n",
+      i, quota_kind_text(s->quota[i].kind), s->quota[i].state);
+
+  if (s->ntunnel > 0)
+    metrics_add(body, &len,
+      "# HELP trafficmeter_tunnel_bytes_total Bytes per tunnel as captured (outer) and encapsulated (inner).\n"
+      "# TYPE trafficmeter_tunnel_bytes_total counter\n");
+  for (i = 0; i < s->ntunnel && i < TM_SHM_TUNNELS; ++i) {
+    const tm_shm_tunnel_t *t = &s->tunnel[i];
+    char id[16];
+
+    tunnel_id_text(t, id, sizeof(id));
+    metrics_add(body, &len,
+      "trafficmeter_tunnel_bytes_total{type=\"%s\",id=\"%s\",layer=\"outer\"} %llu\n"
+      "trafficmeter_tunnel_bytes_total{type=\"%s\",id=\"%s\",layer=\"inner\"} %llu\n",
+      tunnel_type_text(t->type), id, (unsigned long long)t->outer_bytes,
+      tunnel_type_text(t->type), id, (unsigned long long)t->inner_bytes);
+  }
+
+  if (s->ntunnel > 0)
+    metrics_add(body, &len,
+      "# HELP trafficmeter_tunnel_packets_total Packets per tunnel.\n"
+      "# TYPE trafficmeter_tunnel_packets_total counter\n");
+  for (i = 0; i < s->ntunnel && i < TM_SHM_TUNNELS; ++i) {
+    const tm_shm_tunnel_t *t = &s->tunnel[i];
+    char id[16];
+
+    tunnel_id_text(t, id, sizeof(id));
+    metrics_add(body, &len,
+      "trafficmeter_tunnel_packets_total{type=\"%s\",id=\"%s\"} %llu\n",
+      tunnel_type_text(t->type), id, (unsigned long long)t->packets);
+  }
+
+  metrics_add(body, &len,
+    "# HELP trafficmeter_rate_ewma_bytes_per_second Exponentially weighted moving average of the rate.\n"
+    "# TYPE trafficmeter_rate_ewma_bytes_per_second gauge\n"
+    "trafficmeter_rate_ewma_bytes_per_second{window=\"1m\"} %.1f\n"
+    "trafficmeter_rate_ewma_bytes_per_second{window=\"5m\"} %.1f\n"
+    "trafficmeter_rate_ewma_bytes_per_second{window=\"15m\"} %.1f\n"
+    "# HELP trafficmeter_rate_percentile_bytes_per_second Percentiles of the rate per second since the last reset.\n"
+    "# TYPE trafficmeter_rate_percentile_bytes_per_second gauge\n"
+    "trafficmeter_rate_percentile_bytes_per_second{quantile=\"0.5\"} %u\n"
+    "trafficmeter_rate_percentile_bytes_per_second{quantile=\"0.95\"} %u\n"
+    "trafficmeter_rate_percentile_bytes_per_second{quantile=\"0.99\"} %u\n"
+    "# HELP trafficmeter_metered_seconds Seconds counted since the last reset.\n"
+    "# TYPE trafficmeter_metered_seconds gauge\n"
+    "trafficmeter_metered_seconds %llu\n"
+    "# HELP trafficmeter_packet_size_bytes Sizes of the counted packets.\n"
+    "# TYPE trafficmeter_packet_size_bytes histogram\n",
+    s->stats.ewma[0], s->stats.ewma[1], s->stats.ewma[2],
+    s->stats.p50, s->stats.p95, s->stats.p99,
+    (unsigned long long)s->stats.seconds);
+  for (i = 0; i < TM_SHM_SIZES; ++i) {
+    sizes += s->stats.sizes[i];
+    if (i < TM_SHM_SIZES - 1)
+      metrics_add(body, &len, "trafficmeter_packet_size_bytes_bucket{le=\"%u\"} %llu\n",
+                  pkt_size_max[i], (unsigned long long)sizes);
+  }
+  metrics_add(body, &len,
+    "trafficmeter_packet_size_bytes_bucket{le=\"+Inf\"} %llu\n"
+    "trafficmeter_packet_size_bytes_sum %llu\n"
+    "trafficmeter_packet_size_bytes_count %llu\n",
+    (unsigned long long)sizes, (unsigned long long)s->stats.size_sum,
+    (unsigned long long)sizes);
+
+  metrics_add(body, &len,
+    "# HELP trafficmeter_wakeups_total Timer ticks, capture thread wakeups and graph redraws.\n"
+    "# TYPE trafficmeter_wakeups_total counter\n"
+    "trafficmeter_wakeups_total{source=\"timer\"} %llu\n"
+    "trafficmeter_wakeups_total{source=\"capture\"} %llu\n"
+    "trafficmeter_wakeups_total{source=\"redraw\"} %llu\n"
+    "# HELP trafficmeter_wakeups_per_minute Wakeups in the last 60 counted seconds.\n"
+    "# TYPE trafficmeter_wakeups_per_minute gauge\n"
+    "trafficmeter_wakeups_per_minute{source=\"timer\"} %u\n"
+    "trafficmeter_wakeups_per_minute{source=\"capture\"} %u\n"
+    "trafficmeter_wakeups_per_minute{source=\"redraw\"} %u\n"
+    "# HELP trafficmeter_cpu_seconds_total User and system CPU time of the process.\n"
+    "# TYPE trafficmeter_cpu_seconds_total counter\n"
+    "trafficmeter_cpu_seconds_total %llu.%06llu\n",
+    (unsigned long long)s->power.wakeups[TM_SHM_WAKEUP_TIMER],
+    (unsigned long long)s->power.wakeups[TM_SHM_WAKEUP_CAPTURE],
+    (unsigned long long)s->power.wakeups[TM_SHM_WAKEUP_REDRAW],
+    s->power.per_minute[TM_SHM_WAKEUP_TIMER],
+    s->power.per_minute[TM_SHM_WAKEUP_CAPTURE],
+    s->power.per_minute[TM_SHM_WAKEUP_REDRAW],
+    (unsigned long long)(s->power.cpu_usec / G_USEC_PER_SEC),
+    (unsigned long long)(s->power.cpu_usec % G_USEC_PER_SEC));
+
+  for (i = 0; i < s->history_len && i < TM_SHM_HISTORY; ++i) {
+    guint32 v = s->history[(s->history_head + TM_SHM_HISTORY - i) % TM_SHM_HISTORY];
+    sum += v;
+    if (v > max)
+      max = v;
+  }
+  metrics_add(body, &len,
+    "# HELP trafficmeter_history_seconds Seconds in the recent history.\n"
+    "# TYPE trafficmeter_history_seconds gauge\n"
+    "trafficmeter_history_seconds %u\n"
+    "# HELP trafficmeter_history_rate_bytes_per_second Average and peak rate over the recent history.\n"
+    "# TYPE trafficmeter_history_rate_bytes_per_second gauge\n"
+    "trafficmeter_history_rate_bytes_per_second{stat=\"avg\"} %llu\n"
+    "trafficmeter_history_rate_bytes_per_second{stat=\"max\"} %llu\n",
+    s->history_len, s->history_len > 0 ? sum / s->history_len : 0ULL, max);
+
+  return len;
+}
+
+static void metrics_respond(metrics_t *m, metrics_conn_t *c)
+{
+  char head[METRICS_HEAD_MAX];
+  char *body = c->resp + METRICS_HEAD_MAX;
+  const char *status = "200 OK";
+  gsize len = 0;
+  int hlen;
+
+  if (   strncmp(c->req, "GET /metrics", 12) != 0
+      || (c->req[12] != ' ' && c->req[12] != '?')) {
+    status = "404 Not Found";
+    metrics_add(body, &len, "Not found, try /metrics\n");
+  } else {
+    tm_shm_reader_t r;
+    r.seg = shm;
+    if (shm == NULL || !tm_shm_snapshot(&r, &m->snap)) {
+      status = "503 Service Unavailable";
+      metrics_add(body, &len, "Counters are not available\n");
+    } else {
+      len = metrics_body(m, body);
+    }
+  }
+
+  hlen = snprintf(head, sizeof(head),
+                  "HTTP/1.0 %s\r\n"
+                  "Content-Type: text/plain; version=0.0.4\r\n"
+                  "Content-Length: %lu\r\n"
+                  "Connection: close\r\n\r\n", status, (unsigned long)len);
+  memcpy(body - hlen, head, hlen);
+  c->out = body - hlen;
+  c->out_len = hlen + len;
+}
+
+static gboolean metrics_conn_event(GIOChannel *channel, GIOCondition cond,
+                                   gpointer data)
+{
+  metrics_conn_t *c = (metrics_conn_t *)data;
+  ssize_t n;
+
+  if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+    return metrics_conn_done(c);
+
+  if (c->out == NULL) {
+    n = read(c->fd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+      return TRUE;
+    if (n <= 0)
+      return metrics_conn_done(c);
+    c->req_len += n;
+    c->req[c->req_len] = '\0';
+    if (strstr(c->req, "\r\n\r\n") == NULL && strstr(c->req, "\n\n") == NULL) {
+      if (c->req_len < sizeof(c->req) - 1)
+        return TRUE;
+    }
+
+    /* this watch ends by returning FALSE, continue with writing */
+    metrics_respond(metrics, c);
+    c->watch = g_io_add_watch(c->channel, G_IO_OUT | G_IO_ERR | G_IO_HUP,
+                              metrics_conn_event, c);
+    return FALSE;
+  }
+
+  n = write(c->fd, c->out, c->out_len);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return TRUE;
+  if (n <= 0 || (gsize)n == c->out_len)
+    return metrics_conn_done(c);
+  c->out += n;
+  c->out_len -= n;
+  return TRUE;
+}
+
+static gboolean metrics_accept(GIOChannel *channel, GIOCondition cond,
+                               gpointer data)
+{
+  metrics_t *m = (metrics_t *)data;
+  int fd;
+
+  while ((fd = accept(m->fd, NULL, NULL)) >= 0) {
+    metrics_conn_t *c = NULL;
+    unsigned int i;
+
+    /* take a free slot, or the one of the oldest client */
+    for (i = 0; i < METRICS_CONN_MAX; ++i) {
+      if (m->conn[i].fd < 0) {
+        c = &m->conn[i];
+        break;
+      }
+      if (c == NULL || m->conn[i].since < c->since)
+        c = &m->conn[i];
+    }
+    metrics_conn_close(c);
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    c->fd = fd;
+    c->since = time_usec();
+    c->req_len = 0;
+    c->out = NULL;
+    c->out_len = 0;
+    c->channel = g_io_channel_unix_new(fd);
+    c->watch = g_io_add_watch(c->channel, G_IO_IN | G_IO_ERR | G_IO_HUP,
+                              metrics_conn_event, c);
+  }
+  return TRUE;
+}
+
+/* the path comes from the rc file and we may run as root: only a socket,
+   e.g. left behind by a crash, is removed */
+static void metrics_unlink(const char *path)
+{
+  struct stat st;
+
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+}
+
+/* port number of a tcp:PORT endpoint, 0 if it is not one */
+static unsigned short metrics_port(const char *text)
+{
+  gchar *end;
+  guint64 port;
+
+  if (!g_ascii_isdigit(text[0]))
+    return 0;
+  port = g_ascii_strtoull(text, &end, 10);
+  if (*end != '\0' || port < 1 || port > 65535)
+    return 0;
+  return (unsigned short)port;
+}
+
+static metrics_t * metrics_open(const char *spec)
+{
+  metrics_t *m;
+  unsigned int i;
+  unsigned short port = 0;
+  int fd = -1;
+
+  if (strcmp(spec, "none") == 0)
+    return NULL;
+
+  m = (metrics_t *)g_malloc0(sizeof(metrics_t));
+  if (strncmp(spec, "unix:", 5) == 0) {
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    g_strlcpy(sun.sun_path, spec + 5, sizeof(sun.sun_path));
+    g_strlcpy(m->path, spec + 5, sizeof(m->path));
+    metrics_unlink(m->path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  } else if (strncmp(spec, "tcp:", 4) == 0 && (port = metrics_port(spec + 4)) != 0) {
+    struct sockaddr_in sin;
+    int on = 1;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(port);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0)
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (fd >= 0 && bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  } else {
+    g_print("metrics: unknown endpoint %s, use unix:PATH or tcp:PORT\n", spec);
+  }
+
+  if (fd < 0 || listen(fd, METRICS_CONN_MAX) != 0) {
+    g_print("metrics: unable to listen on %s\n", spec);
+    if (fd >= 0)
+      close(fd);
+    g_free(m);
+    return NULL;
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  m->fd = fd;
+  for (i = 0; i < METRICS_CONN_MAX; ++i)
+    m->conn[i].fd = -1;
+  m->channel = g_io_channel_unix_new(fd);
+  m->watch = g_io_add_watch(m->channel, G_IO_IN, metrics_accept, m);
+  g_print("metrics: serving on %s\n", spec);
+  return m;
+}
+
+static void metrics_close(metrics_t *m)
+{
+  unsigned int i;
+
+  if (m == NULL)
+    return;
+  for (i = 0; i < METRICS_CONN_MAX; ++i)
+    metrics_conn_close(&m->conn[i]);
+  g_source_remove(m->watch);
+  g_io_channel_unref(m->channel);
+  close(m->fd);
+  if (m->path[0] != '\0')
+    metrics_unlink(m->path);
+  g_free(m);
+}
+
+#else /* WIN32 */
+
+typedef int metrics_t;
+static metrics_t *metrics = NULL;
+
+static metrics_t * metrics_open(const char *spec)
+{
+  if (strcmp(spec, "none") != 0)
+    g_print("metrics: not supported on Windows, use --watch\n");
+  return NULL;
+}
+
+static void metrics_close(metrics_t *m)
+{
+}
+
+#endif /* WIN32 */
+
+
+/*
+ * quota windows
+ *
+ * Besides the counter with the soft and hard limit of the Settings menu,
+ * up to QUOTA_MAX - 1 windows can be given in the rc file, each with its own
+ * limits and actions, e.g.
+ *
+ *   quotas=3
+ *   quota=month 15 50000000000 60000000000 cnlh /usr/local/bin/quota-hook
+ *   quota=day 0 3000000000 4000000000 cn -
+ *   quota=rolling 300 500000000 800000000 l -
+ *
+ * for a month starting on the 15th, the calendar day and the last 5
+ * minutes. Actions: c colour of the counter, n notification in the status
+ * bar and the tray, l entry in the journal, h the hook command, run with
+ * the window index, its kind, the new state, the usage and the limit as
+ * arguments.
+ *
+ * All bytes ever counted go to quota_total. A window is empty at its base,
+ * so its usage is quota_total - base: the base of a calendar window moves
+ * when a period starts, that of a rolling window once per bucket. The
+ * capture thread only compares quota_total with quota_next, the nearest
+ * limit of all windows, and the windows are evaluated if it is crossed or
+ * the bases have moved.
+ */
+
+#define QUOTA_MAX TM_SHM_QUOTAS
+#define QUOTA_BUCKETS 300               /* resolution of rolling windows */
+#define QUOTA_HOOK_LEN 256
+#define QUOTA_IDLE_TICK 60              /* seconds between ticks while stopped */
+#define QUOTA_UNLIMITED (G_GUINT64_CONSTANT(1) << 62)  /* limits never reached */
+#define QUOTA_ACT_COLOUR 1
+#define QUOTA_ACT_NOTIFY 2
+#define QUOTA_ACT_LOG 4
+#define QUOTA_ACT_HOOK 8
+
+typedef struct
+{
+  guint32  kind;                  /* TM_SHM_QUOTA_* */
+  guint32  param;
+  guint64  soft;
+  guint64  hard;
+  guint32  actions;               /* QUOTA_ACT_* */
+  char     hook[QUOTA_HOOK_LEN];
+
+  gint64   base;                  /* quota_total of an empty window */
+  guint32  state;                 /* TM_SHM_LIMIT_* */
+  guint32  acted;                 /* state the actions were run for */
+  gint64   period_end;            /* calendar windows */
+  guint32  bucket_len;            /* rolling windows: seconds per bucket */
+  guint32  nbuckets;
+  guint32  head;                  /* newest bucket */
+  gint64   bucket_start;
+  gint64   snap[QUOTA_BUCKETS + 1]; /* quota_total at the bucket starts */
+} quota_t;
+
+typedef struct
+{
+  unsigned int  window;
+  guint32       state;
+  guint64       usage;
+  guint64       counter;
+} quota_event_t;
+
+/* protected by data_mutex */
+static quota_t quota[QUOTA_MAX];
+static unsigned int nquota = 1;
+static gint64 quota_total = 0;
+static gint64 quota_next = 0;
+static guint32 quota_colour = TM_SHM_LIMIT_OK;
+
+void update_counter_label(gboolean from_thread);
+
+static guint32 quota_parse_actions(const char *text)
+{
+  guint32 a = 0;
+
+  a |= strchr(text, 'c') ? QUOTA_ACT_COLOUR : 0;
+  a |= strchr(text, 'n') ? QUOTA_ACT_NOTIFY : 0;
+  a |= strchr(text, 'l') ? QUOTA_ACT_LOG : 0;
+  a |= strchr(text, 'h') ? QUOTA_ACT_HOOK : 0;
+  return a;
+}
+
+/* reads the windows after quotas= of the rc file */
+static void quota_read(FILE *f)
+{
+  unsigned int i, n = 0;
+
+  if (fscanf (f, "quotas=%u\n", &n) != 1)
+    return;
+  for (i = 0; i < n; ++i) {
+    char kind[16], actions[8], hook[QUOTA_HOOK_LEN];
+    unsigned int param, k;
+    unsigned long long soft, hard;
+    quota_t *q = &quota[nquota];
+
+    if (fscanf (f, "quota=%15s %u %llu %llu %7s %255[^\n]\n",
+                kind, &param, &soft, &hard, actions, hook) != 6)
+      break;
+    for (k = TM_SHM_QUOTA_ROLLING; k < G_N_ELEMENTS(quota_kind_name); ++k)
+      if (strcmp (kind, quota_kind_name[k]) == 0)
+        break;
+    if (k == G_N_ELEMENTS(quota_kind_name) || nquota == QUOTA_MAX) {
+      g_print ("quota %s ignored\n", kind);
+      continue;
+    }
+    memset (q, 0, sizeof(*q));
+    q->kind = k;
+    q->param = param;
+    if (k == TM_SHM_QUOTA_ROLLING)
+      q->param = MAX(param, 1);
+    else if (k == TM_SHM_QUOTA_MONTH)
+      q->param = CLAMP(param, 1, 28);
+    q->soft = soft;
+    q->hard = hard;
+    q->actions = quota_parse_actions(actions);
+    if (strcmp (hook, "-") != 0)
+      g_strlcpy (q->hook, hook, sizeof(q->hook));
+    ++nquota;
+  }
+}
+
+/* writes the windows for the rc file, takes data_mutex */
+static void quota_write(FILE *f)
+{
+  unsigned int i;
+
+  if (data_mutex) g_mutex_lock (data_mutex);
+  fprintf (f, "quotas=%u\n", nquota - 1);
+  for (i = 1; i < nquota; ++i) {
+    const quota_t *q = &quota[i];
+    fprintf (f, "quota=%s %u %llu %llu %s%s%s%s%s %s\n",
+             quota_kind_name[q->kind], q->param,
+             (unsigned long long)q->soft, (unsigned long long)q->hard,
+             q->actions ? "" : "-",
+             q->actions & QUOTA_ACT_COLOUR ? "c" : "",
+             q->actions & QUOTA_ACT_NOTIFY ? "n" : "",
+             q->actions & QUOTA_ACT_LOG ? "l" : "",
+             q->actions & QUOTA_ACT_HOOK ? "h" : "",
+             q->hook[0] != '\0' ? q->hook : "-");
+  }
+  if (data_mutex) g_mutex_unlock (data_mutex);
+}
+
+/* the calendar period around t */
+static void quota_period(const quota_t *q, gint64 t, gint64 *start, gint64 *end)
+{
+  time_t tt = (time_t)t;
+  struct tm tm = *localtime(&tt);
+
+  tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+  if (q->kind == TM_SHM_QUOTA_MONTH) {
+    if (tm.tm_mday < (int)q->param)
+      tm.tm_mon -= 1;
+    tm.tm_mday = q->param;
+  }
+  tm.tm_isdst = -1;
+  *start = mktime(&tm);
+  if (q->kind == TM_SHM_QUOTA_MONTH)
+    tm.tm_mon += 1;
+  else
+    tm.tm_mday += 1;
+  tm.tm_isdst = -1;
+  *end = mktime(&tm);
+}
+
+/* beginning of the window at time now */
+static gint64 quota_start(quota_t *q, gint64 now)
+{
+  gint64 start, end;
+
+  if (q->kind == TM_SHM_QUOTA_ROLLING) {
+    q->bucket_len = (q->param + QUOTA_BUCKETS - 1) / QUOTA_BUCKETS;
+    q->nbuckets = q->param / q->bucket_len;
+    q->bucket_start = now - now % q->bucket_len;
+    q->head = q->nbuckets;
+    return q->bucket_start - (gint64)q->nbuckets * q->bucket_len;
+  }
+  quota_period(q, now, &start, &end);
+  q->period_end = end;
+  return start;
+}
+
+static void quota_publish(void)
+{
+  unsigned int i;
+
+  if (shm == NULL)
+    return;
+  shm_begin(shm);
+  shm->limit_state = quota[0].state;
+  shm->nquota = nquota;
+  for (i = 0; i < nquota; ++i) {
+    shm->quota[i].kind = quota[i].kind;
+    shm->quota[i].param = quota[i].param;
+    shm->quota[i].state = quota[i].state;
+    shm->quota[i].usage = quota_total - quota[i].base;
+    shm->quota[i].soft_limit = quota[i].soft;
+    shm->quota[i].hard_limit = quota[i].hard;
+  }
+  shm_end(shm);
+}
+
+/* states of the windows and the next limit, with data_mutex held */
+static void quota_update(void)
+{
+  unsigned int i;
+
+  quota_next = G_MAXINT64;
+  quota_colour = TM_SHM_LIMIT_OK;
+  for (i = 0; i < nquota; ++i) {
+    quota_t *q = &quota[i];
+    guint64 usage = quota_total - q->base;
+    guint32 state = TM_SHM_LIMIT_OK;
+
+    if (usage > q->hard)
+      state = TM_SHM_LIMIT_HARD;
+    else if (usage > q->soft)
+      state = TM_SHM_LIMIT_SOFT;
+    q->state = state;
+
+    if (usage <= q->soft && q->soft < QUOTA_UNLIMITED)
+      quota_next = MIN(quota_next, q->base + (gint64)q->soft + 1);
+    if (usage <= q->hard && q->hard < QUOTA_UNLIMITED)
+      quota_next = MIN(quota_next, q->base + (gint64)q->hard + 1);
+    if (q->actions & QUOTA_ACT_COLOUR)
+      quota_colour = MAX(quota_colour, state);
+  }
+  quota_publish();
+}
+
+/* the limits of the Settings menu or a reset, with data_mutex held */
+static void quota_counter_changed(void)
+{
+  quota[0].soft = soft_limit;
+  quota[0].hard = hard_limit;
+  quota[0].base = quota_total - (gint64)bytes;
+  quota_update();
+}
+
+/* initial usage of the windows from the journal, called at start up */
+static void quota_load(void)
+{
+  journal_map_t map;
+  journal_iter_t it;
+  journal_sample_t s;
+  gint64 now = time(NULL);
+  gint64 from = now;
+  gint64 start[QUOTA_MAX];
+  unsigned int i;
+
+  quota[0].kind = TM_SHM_QUOTA_COUNTER;
+  quota[0].actions = QUOTA_ACT_COLOUR;
+  for (i = 1; i < nquota; ++i) {
+    start[i] = quota_start(&quota[i], now);
+    from = MIN(from, start[i]);
+    quota[i].base = quota_total;
+    memset(quota[i].snap, 0, sizeof(quota[i].snap));
+  }
+
+  /* the base is quota_total less the usage so far. For rolling windows the
+     bytes of every bucket are summed up first, then the snapshot of a
+     bucket is quota_total less the usage from its start on. */
+  if (nquota > 1 && journal_map(JOURNALNAME, &map)) {
+    journal_iter_init(&it, &map, from);
+    while (journal_iter_next(&it, &s) && s.time <= now) {
+      if (s.type != JOURNAL_SAMPLE)
+        continue;
+      for (i = 1; i < nquota; ++i) {
+        quota_t *q = &quota[i];
+        if (s.time < start[i])
+          continue;
+        q->base -= s.bytes;
+        if (q->kind == TM_SHM_QUOTA_ROLLING)
+          q->snap[(s.time - start[i]) / q->bucket_len] -= s.bytes;
+      }
+    }
+    journal_unmap(&map);
+  }
+  for (i = 1; i < nquota; ++i) {
+    quota_t *q = &quota[i];
+    guint32 b;
+    if (q->kind != TM_SHM_QUOTA_ROLLING)
+      continue;
+    q->snap[q->nbuckets] += quota_total;
+    for (b = q->nbuckets; b > 0; --b)
+      q->snap[b - 1] += q->snap[b];
+  }
+
+  g_mutex_lock (data_mutex);
+  quota_counter_changed();
+  quota[0].acted = quota[0].state;
+  for (i = 1; i < nquota; ++i)
+    quota[i].acted = quota[i].state;
+  g_mutex_unlock (data_mutex);
+}
+
+/* moves the windows to time now and returns the windows whose state has
+   changed since the actions were run, with data_mutex held */
+static unsigned int quota_tick(gint64 now, quota_event_t *events)
+{
+  unsigned int i, n = 0;
+  gboolean moved = FALSE;
+
+  for (i = 1; i < nquota; ++i) {
+    quota_t *q = &quota[i];
+
+    if (q->kind == TM_SHM_QUOTA_ROLLING) {
+      if (now >= q->bucket_start + (gint64)(q->nbuckets + 1) * q->bucket_len) {
+        /* nothing counted for longer than the window */
+        guint32 b;
+        (void) quota_start(q, now);
+        for (b = 0; b <= q->nbuckets; ++b)
+          q->snap[b] = quota_total;
+        q->base = quota_total;
+        moved = TRUE;
+      } else if (now >= q->bucket_start + q->bucket_len) {
+        do {
+          q->bucket_start += q->bucket_len;
+          q->head = (q->head + 1) % (q->nbuckets + 1);
+          q->snap[q->head] = quota_total;
+        } while (now >= q->bucket_start + q->bucket_len);
+        q->base = q->snap[(q->head + 1) % (q->nbuckets + 1)];
+        moved = TRUE;
+      }
+    } else if (now >= q->period_end) {
+      (void) quota_start(q, now);
+      q->base = quota_total;
+      moved = TRUE;
+    }
+  }
+  if (moved)
+    quota_update();
+  else
+    quota_publish();
+
+  for (i = 0; i < nquota; ++i) {
+    if (quota[i].state == quota[i].acted)
+      continue;
+    quota[i].acted = quota[i].state;
+    events[n].window = i;
+    events[n].state = quota[i].state;
+    events[n].usage = quota_total - quota[i].base;
+    events[n].counter = bytes;
+    ++n;
+  }
+  return n;
+}
+
+static void quota_hook(const quota_t *q, const quota_event_t *e)
+{
+  GError *error = NULL;
+  gchar **hook = NULL;
+  gchar **argv;
+  gint argc, i;
+
+  if (!g_shell_parse_argv(q->hook, &argc, &hook, &error)) {
+    g_printerr("quota hook %s: %s\n", q->hook, error->message);
+    g_error_free(error);
+    return;
+  }
+  argv = g_new0(gchar *, argc + 6);
+  for (i = 0; i < argc; ++i)
+    argv[i] = hook[i];
+  argv[argc] = g_strdup_printf("%u", e->window);
+  argv[argc + 1] = g_strdup(quota_kind_name[q->kind]);
+  argv[argc + 2] = g_strdup(quota_state_name[e->state]);
+  argv[argc + 3] = g_strdup_printf("%llu", (unsigned long long)e->usage);
+  argv[argc + 4] = g_strdup_printf("%llu", (unsigned long long)
+                                   (e->state == TM_SHM_LIMIT_HARD ? q->hard : q->soft));
+  if (!g_spawn_async(NULL, argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, NULL,
+                     &error)) {
+    g_printerr("quota hook %s: %s\n", q->hook, error->message);
+    g_error_free(error);
+  }
+  for (i = argc; i < argc + 5; ++i)
+    g_free(argv[i]);
+  g_free(argv);
+  g_strfreev(hook);
+}
+
+/* runs the actions for the state changes, in the GUI thread */
+static void quota_act(const quota_event_t *events, unsigned int n)
+{
+  gboolean blink = FALSE;
+  unsigned int i;
+
+  for (i = 0; i < n; ++i) {
+    const quota_event_t *e = &events[i];
+    const quota_t *q = &quota[e->window];
+
+    if (q->actions & QUOTA_ACT_LOG)
+      journal_append_arg(journal, JOURNAL_QUOTA_OK + e->state, e->window, 0,
+                         e->counter, dev);
+    if (q->actions & QUOTA_ACT_NOTIFY) {
+      gchar *text = g_strdup_printf("%s quota: %s", quota_kind_name[q->kind],
+                                    e->state == TM_SHM_LIMIT_HARD ? "hard limit reached"
+                                    : e->state == TM_SHM_LIMIT_SOFT ? "soft limit reached"
+                                    : "below the limits");
+      gtk_statusbar_pop (GTK_STATUSBAR (statusbar), context_id);
+      (void)gtk_statusbar_push (GTK_STATUSBAR (statusbar), context_id, text);
+      g_free(text);
+    }
+    if ((q->actions & QUOTA_ACT_HOOK) && q->hook[0] != '\0')
+      quota_hook(q, e);
+  }
+
+  for (i = 0; i < nquota; ++i)
+    if ((quota[i].actions & QUOTA_ACT_NOTIFY) && quota[i].acted != TM_SHM_LIMIT_OK)
+      blink = TRUE;
+  gtk_status_icon_set_blinking (tray_icon, blink);
+}
+
+/* moves the windows to now outside timer_handler, which only runs while
+   started, so that the periods roll over and the state is published when
+   nothing is counted */
+static void quota_tick_now(void)
+{
+  quota_event_t events[QUOTA_MAX];
+  unsigned int nevents;
+
+  g_mutex_lock (data_mutex);
+  nevents = quota_tick(time(NULL), events);
+  g_mutex_unlock (data_mutex);
+
+  if (nevents > 0) {
+    quota_act(events, nevents);
+    update_counter_label(FALSE);
+  }
+}
+
+static gboolean quota_idle_handler(gpointer data)
+{
+  if (!started)
+    quota_tick_now();
+  return TRUE;
+}
+
+
+/* interface hardware address, to tell the direction of the packets */
+
+static gboolean iface_hwaddr(const char *name, guint8 mac[6])
+{
+#ifdef WIN32
+  return FALSE;
+#else /* !WIN32 */
+  char path[128];
+  unsigned int m[6];
+  int i, n;
+  FILE *f;
+
+  snprintf(path, sizeof(path), "/sys/class/net/%s/address", name);
+  f = fopen(path, "r");
+  if (f == NULL)
+    return FALSE;
+  n = fscanf(f, "%x:%x:%x:%x:%x:%x", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]);
+  fclose(f);
+  if (n != 6)
+    return FALSE;
+  for (i = 0; i < 6; ++i)
+    mac[i] = (guint8)m[i];
+  return TRUE;
+#endif /* !WIN32 */
+}
+
+/*
+ * interface discovery
+ *
+ * pcap_findalldevs() can take long on hosts with many interfaces, so it
+ * runs in a thread of its own and the combo box is filled from the main
+ * loop when it returns; the device of the rc file is in the combo box from
+ * the start. On Linux, links that appear, disappear or are renamed later
+ * on are followed through an rtnetlink socket served by the main loop.
+ *
+ * The device is stored by name and ifindex. The name comes first, the
+ * ifindex finds an interface that has been renamed, e.g. by udev. A
+ * capture whose interface went away waits for it in the counter thread,
+ * woken by the link events or every IFACE_RETRY_SEC, and reattaches.
+ */
+
+#define IFACE_RETRY_SEC 5
+#define IFACE_NL_BUF 16384
+
+typedef struct
+{
+  char  name[DEVICE_NAME_LEN];
+  guint ifindex;                  /* 0 for pcap pseudo devices */
+} iface_row_t;
+
+typedef struct
+{
+  GPtrArray *names;               /* NULL if pcap_findalldevs() failed */
+  char       errbuf[PCAP_ERRBUF_SIZE];
+} iface_list_t;
+
+static GArray *iface_rows = NULL;  /* the rows of the combo box, main loop only */
+static gint device_legacy = -1;    /* combo box row of an old device=N rc entry */
+static GCond *iface_cond = NULL;   /* with data_mutex: the device may be back */
+static guint capture_gen = 0;      /* protected by data_mutex, counts the starts */
+static gboolean iface_enum_busy = FALSE;
+
+static guint iface_index(const char *name)
+{
+#ifdef WIN32
+  return 0;
+#else /* !WIN32 */
+  return if_nametoindex(name);
+#endif /* !WIN32 */
+}
+
+/* whether the device is known to be missing, as opposed to not usable */
+static gboolean iface_missing(const char *name)
+{
+#ifdef WIN32
+  return FALSE;
+#else /* !WIN32 */
+  return strcmp(name, "any") != 0 && if_nametoindex(name) == 0;
+#endif /* !WIN32 */
+}
+
+/* rc files before 0.0.8 stored the row of the combo box */
+static void iface_legacy(char *name)
+{
+  if (name[0] != '\0' && strspn(name, "0123456789") == strlen(name)) {
+    device_legacy = atoi(name);
+    strcpy(name, "-");
+  }
+}
+
+/* called before the window is built: follow a renamed device */
+static void iface_resolve(void)
+{
+#ifndef WIN32
+  char name[IF_NAMESIZE];
+
+  if (   strcmp(device_name, "-") != 0 && device_ifindex != 0
+      && iface_missing(device_name)
+      && if_indextoname(device_ifindex, name) != NULL) {
+    g_print("device %s is now called %s\n", device_name, name);
+    g_strlcpy(device_name, name, sizeof(device_name));
+  }
+#endif /* !WIN32 */
+}
+
+static gint iface_row_find(const char *name)
+{
+  guint i;
+
+  for (i = 0; i < iface_rows->len; ++i)
+    if (strcmp(g_array_index(iface_rows, iface_row_t, i).name, name) == 0)
+      return i;
+  return -1;
+}
+
+static gint iface_row_find_index(guint ifindex)
+{
+  guint i;
+
+  if (ifindex == 0)
+    return -1;
+  for (i = 0; i < iface_rows->len; ++i)
+    if (g_array_index(iface_rows, iface_row_t, i).ifindex == ifindex)
+      return i;
+  return -1;
+}
+
+static void iface_row_add(const char *name, guint ifindex)
+{
+  iface_row_t row;
+
+  g_strlcpy(row.name, name, sizeof(row.name));
+  row.ifindex = ifindex;
+  g_array_append_val(iface_rows, row);
+  gtk_combo_box_append_text(GTK_COMBO_BOX(combo), name);
+}
+
+/* the selected row stays, it is the persisted choice */
+static void iface_row_remove(gint i)
+{
+  if (i < 0 || i == gtk_combo_box_get_active(GTK_COMBO_BOX(combo)))
+    return;
+  g_array_remove_index(iface_rows, i);
+  gtk_combo_box_remove_text(GTK_COMBO_BOX(combo), i);
+}
+
+/* select a row if none is, dev follows the selection until the start */
+static void iface_select_default(void)
+{
+  if (gtk_combo_box_get_active(GTK_COMBO_BOX(combo)) >= 0 || iface_rows->len == 0)
+    return;
+  if (device_legacy >= 0 && (guint)device_legacy < iface_rows->len)
+    gtk_combo_box_set_active(GTK_COMBO_BOX(combo), device_legacy);
+  else
+    gtk_combo_box_set_active(GTK_COMBO_BOX(combo), 0);
+  device_legacy = -1;
+
+  if (dev == NULL) {
+    dev = gtk_combo_box_get_active_text(GTK_COMBO_BOX(combo));
+    if (dev != NULL)
+      update_counter_label(FALSE);
+  }
+}
+
+/* main loop: merge the result of the enumeration thread */
+static gboolean iface_list_ready(gpointer data)
+{
+  iface_list_t *list = (iface_list_t *)data;
+  guint i;
+
+  iface_enum_busy = FALSE;
+  if (list->names == NULL) {
+    char text[PCAP_ERRBUF_SIZE + 64];
+    fprintf(stderr, "Couldn't create device list: %s\n", list->errbuf);
+    g_snprintf(text, sizeof(text), "Couldn't create device list: %s", list->errbuf);
+    gtk_statusbar_pop (GTK_STATUSBAR (statusbar), context_id);
+    (void)gtk_statusbar_push (GTK_STATUSBAR (statusbar), context_id, text);
+  } else {
+    fprintf(stderr, "The following interfaces are available:\n");
+    for (i = 0; i < list->names->len; ++i) {
+      const char *name = (const char *)g_ptr_array_index(list->names, i);
+      if (iface_row_find(name) < 0) {
+        iface_row_add(name, iface_index(name));
+        fprintf(stderr, "  %s appended\n", name);
+      }
+    }
+    g_ptr_array_free(list->names, TRUE);
+  }
+  g_free(list);
+
+  iface_select_default();
+  return FALSE;
+}
+
+static gpointer iface_enum_thread(gpointer data)
+{
+  iface_list_t *list = g_new0(iface_list_t, 1);
+  pcap_if_t *iflst = NULL;
+  pcap_if_t *iface;
+
+  if (pcap_findalldevs(&iflst, list->errbuf) != -1) {
+    list->names = g_ptr_array_new_with_free_func(g_free);
+    for (iface = iflst; iface != NULL; iface = iface->next)
+      g_ptr_array_add(list->names, g_strdup(iface->name));
+    pcap_freealldevs(iflst);
+  }
+  g_idle_add(iface_list_ready, list);
+  return NULL;
+}
+
+static void iface_discover(void)
+{
+  GError *error = NULL;
+
+  if (iface_enum_busy)
+    return;
+  if (!g_thread_create(&iface_enum_thread, NULL, FALSE, &error)) {
+    g_printerr ("Failed to create interface discovery thread: %s\n", error->message);
+    g_error_free (error);
+    return;
+  }
+  iface_enum_busy = TRUE;
+}
+
+/* main loop: a link appeared or changed */
+static void iface_link_new(guint ifindex, const char *name)
+{
+  gint i = iface_row_find(name);
+  gint k = iface_row_find_index(ifindex);
+
+  if (k >= 0 && k != i) {
+    /* renamed, the row of the old name goes unless it is selected */
+    g_array_index(iface_rows, iface_row_t, k).ifindex = 0;
+    iface_row_remove(k);
+    i = iface_row_find(name);
+  }
+  if (i < 0)
+    iface_row_add(name, ifindex);
+  else
+    g_array_index(iface_rows, iface_row_t, i).ifindex = ifindex;
+  iface_select_default();
+
+  g_mutex_lock (data_mutex);
+  if (strcmp(device_name, name) == 0) {
+    if (device_ifindex != ifindex) {
+      device_ifindex = ifindex;
+      checkpoint_request (checkpoint);
+    }
+    g_cond_broadcast (iface_cond);
+  }
+  g_mutex_unlock (data_mutex);
+}
+
+static void iface_link_del(guint ifindex, const char *name)
+{
+  iface_row_remove(iface_row_find(name));
+}
+
+#ifndef WIN32
+
+static int iface_nl_fd = -1;
+static GIOChannel *iface_nl_channel = NULL;
+
+static void iface_nl_msg(const struct nlmsghdr *nh)
+{
+  const struct ifinfomsg *ifi = (const struct ifinfomsg *)NLMSG_DATA(nh);
+  const struct rtattr *rta;
+  int len = IFLA_PAYLOAD(nh);
+  char name[IF_NAMESIZE + 1] = "";
+
+  if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+    return;
+  for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+    if (rta->rta_type == IFLA_IFNAME) {
+      gsize n = MIN(RTA_PAYLOAD(rta), IF_NAMESIZE);
+      memcpy(name, RTA_DATA(rta), n);
+      name[n] = '\0';
+    }
+  }
+  if (name[0] == '\0')
+    return;
+
+  if (nh->nlmsg_type == RTM_NEWLINK)
+    iface_link_new(ifi->ifi_index, name);
+  else
+    iface_link_del(ifi->ifi_index, name);
+}
+
+static gboolean iface_nl_event(GIOChannel *channel, GIOCondition cond, gpointer data)
+{
+  static char buf[IFACE_NL_BUF];
+
+  for (;;) {
+    const struct nlmsghdr *nh;
+    ssize_t n = recv(iface_nl_fd, buf, sizeof(buf), 0);
+    int len;
+
+    if (n < 0) {
+      /* the kernel dropped events, start over with a new enumeration */
+      if (errno == ENOBUFS)
+        iface_discover();
+      if (errno == EINTR || errno == ENOBUFS)
+        continue;
+      break;
+    }
+    len = (int)n;
+    for (nh = (const struct nlmsghdr *)buf; NLMSG_OK(nh, len);
+         nh = NLMSG_NEXT(nh, len)) {
+      if (nh->nlmsg_type == RTM_NEWLINK || nh->nlmsg_type == RTM_DELLINK)
+        iface_nl_msg(nh);
+    }
+  }
+  return TRUE;
+}
+
+static void iface_watch(void)
+{
+  struct sockaddr_nl sa;
+
+  iface_nl_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+  if (iface_nl_fd < 0) {
+    g_print("rtnetlink socket cannot be opened, no interface hotplug\n");
+    return;
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.nl_family = AF_NETLINK;
+  sa.nl_groups = RTMGRP_LINK;
+  if (   bind(iface_nl_fd, (struct sockaddr *)&sa, sizeof(sa)) != 0
+      || fcntl(iface_nl_fd, F_SETFL, O_NONBLOCK) != 0) {
+    g_print("rtnetlink socket cannot be bound, no interface hotplug\n");
+    close(iface_nl_fd);
+    iface_nl_fd = -1;
+    return;
+  }
+  iface_nl_channel = g_io_channel_unix_new(iface_nl_fd);
+  g_io_add_watch(iface_nl_channel, G_IO_IN, iface_nl_event, NULL);
+}
+
+#else /* WIN32 */
+
+/* no link events, a lost capture is retried every IFACE_RETRY_SEC */
+static void iface_watch(void)
+{
+}
+
+#endif /* WIN32 */
+
+/* set up the combo box with the stored device and start the discovery */
+static void iface_open(void)
+{
+  iface_rows = g_array_new(FALSE, FALSE, sizeof(iface_row_t));
+  iface_cond = g_cond_new();
+  if (strcmp(device_name, "-") != 0) {
+    iface_row_add(device_name, device_ifindex);
+    gtk_combo_box_set_active(GTK_COMBO_BOX(combo), 0);
+  }
+  iface_watch();
+  iface_discover();
+}
+
+/*
+ * packet header parsing, without OS specific headers
+ *
+ * The addresses and ports are those of the outer IP header, the one the
+ * link carries. Below it VLAN tags and GRE, VXLAN and GENEVE headers are
+ * walked down to the innermost packet, whose length is the useful traffic
+ * of the outermost tunnel. ESP and WireGuard are encrypted, their payload
+ * counts as inner bytes. At most PACKET_HEADERS headers are looked at, so
+ * nested or malformed encapsulation costs bounded work.
+ */
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_IPV6 0x86dd
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88a8
+#define ETHERTYPE_QINQ_OLD 0x9100
+#define ETHERTYPE_TEB 0x6558              /* Ethernet frame, in GRE and GENEVE */
+#define PROTO_TCP 6
+#define PROTO_UDP 17
+#define PROTO_GRE 47
+#define PROTO_ESP 50
+#define PORT_IPSEC_NAT 4500
+#define PORT_VXLAN 4789
+#define PORT_GENEVE 6081
+#define PACKET_HEADERS 8
+
+typedef struct
+{
+  int      dir;                   /* TM_SHM_IN, TM_SHM_OUT */
+  gboolean dir_known;             /* FALSE: the link does not tell, dir is IN */
+  int      family;                /* 4, 6 or 0 if not IP */
+  guint8   proto;                 /* transport protocol */
+  guint8   src[16];               /* IPv4 addresses use the first 4 bytes */
+  guint8   dst[16];
+  guint16  sport;                 /* TCP or UDP only */
+  guint16  dport;
+  guint16  ip_id;                 /* IPv4 only */
+  guint16  ip_len;                /* IP header + payload */
+  guint32  tcp_seq;
+  guint16  l4_check;              /* TCP or UDP checksum */
+  guint8   tunnel;                /* TM_SHM_TUNNEL_*, the outermost one */
+  guint32  tunnel_id;
+  guint32  inner_len;             /* bytes inside the tunnel */
+} packet_info_t;
+
+#define GET16(p) ((guint16)(((p)[0] << 8) | (p)[1]))
+#define GET32(p) (((guint32)(p)[0] << 24) | ((guint32)(p)[1] << 16) \
+                  | ((guint32)(p)[2] << 8) | (guint32)(p)[3])
+
+static int packet_direction(int linktype, const u_char *packet,
+                            bpf_u_int32 caplen, const guint8 *mac,
+                            gboolean *known)
+{
+  *known = TRUE;
+  switch (linktype) {
+    case DLT_EN10MB:
+      if (mac == NULL)
+        *known = FALSE;
+      else if (caplen >= 12 && memcmp(packet + 6, mac, 6) == 0)
+        return TM_SHM_OUT;
+      break;
+#ifdef DLT_LINUX_SLL
+    case DLT_LINUX_SLL:
+      /* packet type 4 is PACKET_OUTGOING */
+      if (caplen >= 2 && packet[0] == 0 && packet[1] == 4)
+        return TM_SHM_OUT;
+      break;
+#endif /* DLT_LINUX_SLL */
+#ifdef DLT_LINUX_SLL2
+    case DLT_LINUX_SLL2:
+      /* the packet type moved to offset 10 */
+      if (caplen >= 11 && packet[10] == 4)
+        return TM_SHM_OUT;
+      break;
+#endif /* DLT_LINUX_SLL2 */
+    default:
+      /* raw IP of tun devices, PPP and the like */
+      *known = FALSE;
+      break;
+  }
+  return TM_SHM_IN;
+}
+
+/* IP header at p, returns the transport header or NULL */
+static const u_char * packet_parse_ip(const u_char *p, const u_char *end,
+                                      packet_info_t *pi)
+{
+  const u_char *l4;
+
+  if (end - p < 1)
+    return NULL;
+
+  if ((p[0] >> 4) == 4) {
+    unsigned int hlen = (p[0] & 0x0f) * 4;
+    if (hlen < 20 || end - p < (long)hlen)
+      return NULL;
+    pi->family = 4;
+    pi->ip_len = GET16(p + 2);
+    pi->ip_id = GET16(p + 4);
+    pi->proto = p[9];
+    memcpy(pi->src, p + 12, 4);
+    memcpy(pi->dst, p + 16, 4);
+    /* only the first fragment has the transport header */
+    if ((GET16(p + 6) & 0x1fff) != 0)
+      return NULL;
+    l4 = p + hlen;
+  } else if ((p[0] >> 4) == 6) {
+    if (end - p < 40)
+      return NULL;
+    pi->family = 6;
+    pi->ip_len = 40 + GET16(p + 4);
+    pi->proto = p[6];
+    memcpy(pi->src, p + 8, 16);
+    memcpy(pi->dst, p + 24, 16);
+    l4 = p + 40;
+  } else {
+    return NULL;
+  }
+
+  if ((pi->proto == PROTO_TCP || pi->proto == PROTO_UDP) && end - l4 >= 4) {
+    pi->sport = GET16(l4);
+    pi->dport = GET16(l4 + 2);
+    if (pi->proto == PROTO_TCP && end - l4 >= 8)
+      pi->tcp_seq = GET32(l4 + 4);
+    if (pi->proto == PROTO_TCP && end - l4 >= 18)
+      pi->l4_check = GET16(l4 + 16);
+    else if (pi->proto == PROTO_UDP && end - l4 >= 8)
+      pi->l4_check = GET16(l4 + 6);
+  }
+  return l4;
+}
+
+/* the outermost tunnel is accounted, VLAN tags only if there is none */
+static void packet_tunnel(packet_info_t *pi, guint8 type, guint32 id)
+{
+  if (pi->tunnel != TM_SHM_TUNNEL_NONE && pi->tunnel != TM_SHM_TUNNEL_VLAN)
+    return;
+  pi->tunnel = type;
+  pi->tunnel_id = id;
+}
+
+/* tunnel header in the transport payload at l4 of an IP packet ip with
+   l4_len bytes from l4 on. Returns the ethertype of the encapsulated header
+   moving *p to it, or 0 if there is nothing more to walk. */
+static guint16 packet_parse_tunnel(packet_info_t *pi, const packet_info_t *ip,
+                                   const u_char *l4, const u_char *end,
+                                   long l4_len, const u_char **p)
+{
+  const u_char *u = l4 + 8;       /* UDP payload */
+  long hlen;
+
+  if (ip->proto == PROTO_GRE) {
+    guint16 flags;
+    guint32 key = 0;
+
+    if (end - l4 < 4)
+      return 0;
+    flags = GET16(l4);
+    if ((flags & 0x0007) != 0)    /* version 0 only, not PPTP */
+      return 0;
+    hlen = 4 + (flags & 0x8000 ? 4 : 0);
+    if (flags & 0x2000) {
+      if (end - l4 < hlen + 4)
+        return 0;
+      key = GET32(l4 + hlen);
+      hlen += 4;
+    }
+    hlen += flags & 0x1000 ? 4 : 0;
+    if (end - l4 < hlen)
+      return 0;
+    packet_tunnel(pi, TM_SHM_TUNNEL_GRE, key);
+    pi->inner_len = MAX(l4_len - hlen, 0);
+    *p = l4 + hlen;
+    return GET16(l4 + 2);
+  }
+
+  if (ip->proto == PROTO_ESP) {
+    if (end - l4 < 8)
+      return 0;
+    packet_tunnel(pi, TM_SHM_TUNNEL_ESP, GET32(l4));
+    pi->inner_len = MAX(l4_len - 8, 0);
+    return 0;
+  }
+
+  if (ip->proto != PROTO_UDP || end - u < 8)
+    return 0;
+  l4_len -= 8;
+
+  if (ip->dport == PORT_VXLAN && (u[0] & 0x08)) {
+    packet_tunnel(pi, TM_SHM_TUNNEL_VXLAN, GET32(u + 4) >> 8);
+    pi->inner_len = MAX(l4_len - 8, 0);
+    *p = u + 8;
+    return ETHERTYPE_TEB;
+  }
+
+  if (ip->dport == PORT_GENEVE && (u[0] >> 6) == 0) {
+    hlen = 8 + (u[0] & 0x3f) * 4;
+    if (end - u < hlen)
+      return 0;
+    packet_tunnel(pi, TM_SHM_TUNNEL_GENEVE, GET32(u + 4) >> 8);
+    pi->inner_len = MAX(l4_len - hlen, 0);
+    *p = u + hlen;
+    return GET16(u + 2);
+  }
+
+  /* ESP in UDP, a zero SPI is the marker of IKE */
+  if (   (ip->sport == PORT_IPSEC_NAT || ip->dport == PORT_IPSEC_NAT)
+      && GET32(u) != 0) {
+    packet_tunnel(pi, TM_SHM_TUNNEL_ESP, GET32(u));
+    pi->inner_len = MAX(l4_len - 8, 0);
+    return 0;
+  }
+
+  /* WireGuard transport data: type 4, 3 reserved bytes, receiver index,
+     counter, then the padded payload and a 16 byte tag; the pattern is
+     too weak for arbitrary UDP, so one end must be the listen port */
+  if (   wireguard_port != 0
+      && (ip->sport == wireguard_port || ip->dport == wireguard_port)
+      && u[0] == 4 && u[1] == 0 && u[2] == 0 && u[3] == 0
+      && l4_len >= 32 && l4_len % 16 == 0) {
+    packet_tunnel(pi, TM_SHM_TUNNEL_WIREGUARD, GET32(u + 4));
+    pi->inner_len = l4_len - 32;
+  }
+  return 0;
+}
+
+static void packet_parse(int linktype, const u_char *packet, bpf_u_int32 caplen,
+                         bpf_u_int32 len, const guint8 *mac, packet_info_t *pi)
+{
+  const u_char *end = packet + caplen;
+  const u_char *p = packet;
+  packet_info_t inner;
+  packet_info_t *ip = pi;         /* gets the next IP header */
+  guint16 type;                   /* ethertype of the header at p */
+  int n;
+
+  memset(pi, 0, sizeof(*pi));
+  pi->dir = packet_direction(linktype, packet, caplen, mac, &pi->dir_known);
+
+  switch (linktype) {
+    case DLT_EN10MB:
+      type = ETHERTYPE_TEB;
+      break;
+#ifdef DLT_LINUX_SLL
+    case DLT_LINUX_SLL:
+      if (caplen < 16)
+        return;
+      type = GET16(packet + 14);
+      p = packet + 16;
+      break;
+#endif /* DLT_LINUX_SLL */
+#ifdef DLT_LINUX_SLL2
+    case DLT_LINUX_SLL2:
+      if (caplen < 20)
+        return;
+      type = GET16(packet);
+      p = packet + 20;
+      break;
+#endif /* DLT_LINUX_SLL2 */
+    case DLT_RAW:
+      type = ETHERTYPE_IPV4;      /* the version is in the IP header */
+      break;
+    case DLT_NULL:
+#ifdef DLT_LOOP
+    case DLT_LOOP:
+#endif /* DLT_LOOP */
+      /* the address family is in host or network byte order, skip it */
+      if (caplen < 4)
+        return;
+      type = ETHERTYPE_IPV4;
+      p = packet + 4;
+      break;
+    default:
+      return;
+  }
+
+  for (n = 0; n < PACKET_HEADERS && type != 0; ++n) {
+    const u_char *l4;
+
+    switch (type) {
+      case ETHERTYPE_TEB:
+        if (end - p < 14)
+          return;
+        type = GET16(p + 12);
+        p += 14;
+        pi->inner_len = len - MIN(len, (bpf_u_int32)(p - packet));
+        break;
+      case ETHERTYPE_VLAN:
+      case ETHERTYPE_QINQ:
+      case ETHERTYPE_QINQ_OLD:
+        if (end - p < 4)
+          return;
+        /* the tags of the outer frame, QinQ as outer << 12 | inner */
+        if (pi->family == 0 && pi->tunnel == TM_SHM_TUNNEL_NONE)
+          packet_tunnel(pi, TM_SHM_TUNNEL_VLAN, GET16(p) & 0x0fff);
+        else if (pi->family == 0 && pi->tunnel == TM_SHM_TUNNEL_VLAN)
+          pi->tunnel_id = pi->tunnel_id << 12 | (GET16(p) & 0x0fff);
+        type = GET16(p + 2);
+        p += 4;
+        pi->inner_len = len - MIN(len, (bpf_u_int32)(p - packet));
+        break;
+      case ETHERTYPE_IPV4:
+      case ETHERTYPE_IPV6:
+        if (pi->family != 0) {
+          memset(&inner, 0, sizeof(inner));
+          ip = &inner;
+        }
+        l4 = packet_parse_ip(p, end, ip);
+        if (ip->family == 0)
+          return;
+        pi->inner_len = ip->ip_len;
+        if (l4 == NULL)
+          return;
+        type = packet_parse_tunnel(pi, ip, l4, end,
+                                   (long)ip->ip_len - (l4 - p), &p);
+        break;
+      default:
+        return;
+    }
+  }
+}
+
+/* trafficmeter --replay CAPTURE...: the tunnel accounting of recorded
+   captures, to check it against other tools */
+static int packet_replay(int argc, char *argv[])
+{
+  tm_shm_tunnel_t tunnel[TM_SHM_TUNNELS];
+  guint32 ntunnel = 0;
+  guint64 packets = 0, total = 0;
+  unsigned int i;
+  int a;
+
+  if (argc < 1) {
+    fprintf(stderr, "usage: trafficmeter --replay CAPTURE...\n");
+    return 2;
+  }
+
+  memset(tunnel, 0, sizeof(tunnel));
+  for (a = 0; a < argc; ++a) {
+    char errbuf[PCAP_ERRBUF_SIZE];
+    struct pcap_pkthdr header;
+    const u_char *packet;
+    packet_info_t pi;
+    int linktype;
+    pcap_t *handle = pcap_open_offline(argv[a], errbuf);
+
+    if (handle == NULL) {
+      fprintf(stderr, "Couldn't open %s: %s\n", argv[a], errbuf);
+      return 1;
+    }
+    linktype = pcap_datalink(handle);
+    while ((packet = pcap_next(handle, &header)) != NULL) {
+      packet_parse(linktype, packet, header.caplen, header.len, NULL, &pi);
+      ++packets;
+      total += header.len;
+      if (pi.tunnel != TM_SHM_TUNNEL_NONE)
+        tunnel_count(tunnel, &ntunnel, pi.tunnel, pi.tunnel_id,
+                     header.len, pi.inner_len);
+    }
+    pcap_close(handle);
+  }
+
+  printf("total\t\t%llu\t%llu\n",
+         (unsigned long long)packets, (unsigned long long)total);
+  for (i = 0; i < ntunnel; ++i) {
+    char id[16];
+    tunnel_id_text(&tunnel[i], id, sizeof(id));
+    printf("%s\t%s\t%llu\t%llu\t%llu\n", tunnel_type_name[tunnel[i].type], id,
+           (unsigned long long)tunnel[i].packets,
+           (unsigned long long)tunnel[i].outer_bytes,
+           (unsigned long long)tunnel[i].inner_bytes);
+  }
+  return 0;
+}
+
+/*
+ * duplicate suppression
+ *
+ * Capturing on several interfaces at once (the "any" device) shows the same
+ * packet on a bond and its slaves, a bridge and its ports or a VLAN and its
+ * parent. Every IP packet gets a fingerprint of header fields that are the
+ * same on all of them, and a packet whose fingerprint was seen shortly
+ * before is not counted again. The fingerprints are kept in two Bloom
+ * filters of fixed size: new ones go to the current filter, lookups check
+ * both. The older one is cleared and becomes the current one after
+ * DEDUP_WINDOW_MS or DEDUP_CAPACITY packets, whichever comes first, which
+ * keeps the memory and the false positive rate bounded: with 2^20 bits,
+ * 3 hashes and at most 2^15 fingerprints a filter is wrong for at most
+ * 0.07% of the lookups, so up to 0.15% of the packets may be dropped as
+ * duplicates they are not. Single interfaces show no duplicates at all,
+ * thus only the cooked captures of the "any" device are checked.
+ */
+
+#define DEDUP_BITS_LOG2 20
+#define DEDUP_BITS (1 << DEDUP_BITS_LOG2)
+#define DEDUP_CAPACITY (DEDUP_BITS / 32)
+#define DEDUP_WINDOW_MS 20
+
+typedef struct
+{
+  guint64      *bits[2];          /* DEDUP_BITS bits each */
+  unsigned int  current;
+  unsigned int  count;            /* fingerprints in the current filter */
+  gint64        rotate_at;        /* packet time in microseconds */
+} dedup_t;
+
+/* with data_mutex held */
+static gboolean dedup_wanted(int linktype)
+{
+  switch (linktype) {
+#ifdef DLT_LINUX_SLL
+    case DLT_LINUX_SLL:
+#endif /* DLT_LINUX_SLL */
+#ifdef DLT_LINUX_SLL2
+    case DLT_LINUX_SLL2:
+#endif /* DLT_LINUX_SLL2 */
+      return dedup;
+    default:
+      return FALSE;
+  }
+}
+
+static dedup_t * dedup_new(void)
+{
+  dedup_t *d = (dedup_t *)g_malloc0(sizeof(dedup_t));
+
+  d->bits[0] = (guint64 *)g_malloc0(DEDUP_BITS / 8);
+  d->bits[1] = (guint64 *)g_malloc0(DEDUP_BITS / 8);
+  return d;
+}
+
+static void dedup_free(dedup_t *d)
+{
+  if (d == NULL)
+    return;
+  g_free(d->bits[0]);
+  g_free(d->bits[1]);
+  g_free(d);
+}
+
+static guint64 dedup_mix(guint64 h, guint64 v)
+{
+  h ^= v;
+  h *= G_GUINT64_CONSTANT(0x9e3779b97f4a7c15);
+  return h ^ (h >> 29);
+}
+
+/* the direction is left out, a forwarded packet goes in on one port and out
+   on another */
+static guint64 dedup_fingerprint(const packet_info_t *pi)
+{
+  guint64 a[4];
+  guint64 h;
+
+  memcpy(a, pi->src, 16);
+  memcpy(a + 2, pi->dst, 16);
+  h = dedup_mix(0, (guint64)pi->family | (guint64)pi->proto << 8
+                   | (guint64)pi->ip_len << 16 | (guint64)pi->ip_id << 32
+                   | (guint64)pi->l4_check << 48);
+  h = dedup_mix(h, a[0]);
+  h = dedup_mix(h, a[1]);
+  h = dedup_mix(h, a[2]);
+  h = dedup_mix(h, a[3]);
+  h = dedup_mix(h, (guint64)pi->sport | (guint64)pi->dport << 16
+                   | (guint64)pi->tcp_seq << 32);
+  return h;
+}
+
+#define DEDUP_BIT(h, i) (((h) >> ((i) * DEDUP_BITS_LOG2)) & (DEDUP_BITS - 1))
+#define DEDUP_TEST(b, n) (((b)[(n) >> 6] >> ((n) & 63)) & 1)
+#define DEDUP_SET(b, n) ((b)[(n) >> 6] |= G_GUINT64_CONSTANT(1) << ((n) & 63))
+
+/* TRUE if the packet was seen within the window, otherwise remembers it */
+static gboolean dedup_seen(dedup_t *d, const packet_info_t *pi,
+                           const struct timeval *ts)
+{
+  gint64 now = (gint64)ts->tv_sec * G_USEC_PER_SEC + ts->tv_usec;
+  guint64 h;
+  guint64 n0, n1, n2;
+  guint64 *cur, *old;
+
+  if (pi->family == 0)
+    return FALSE;
+
+  if (now >= d->rotate_at || d->count >= DEDUP_CAPACITY) {
+    /* after a quiet period the older filter is out of the window, too */
+    if (now >= d->rotate_at + DEDUP_WINDOW_MS * 1000)
+      memset(d->bits[d->current], 0, DEDUP_BITS / 8);
+    d->current ^= 1;
+    memset(d->bits[d->current], 0, DEDUP_BITS / 8);
+    d->count = 0;
+    d->rotate_at = now + DEDUP_WINDOW_MS * 1000;
+  }
+  cur = d->bits[d->current];
+  old = d->bits[d->current ^ 1];
+
+  h = dedup_fingerprint(pi);
+  n0 = DEDUP_BIT(h, 0);
+  n1 = DEDUP_BIT(h, 1);
+  n2 = DEDUP_BIT(h, 2);
+  if (DEDUP_TEST(cur, n0) && DEDUP_TEST(cur, n1) && DEDUP_TEST(cur, n2))
+    return TRUE;
+  if (DEDUP_TEST(old, n0) && DEDUP_TEST(old, n1) && DEDUP_TEST(old, n2))
+    return TRUE;
+  DEDUP_SET(cur, n0);
+  DEDUP_SET(cur, n1);
+  DEDUP_SET(cur, n2);
+  ++d->count;
+  return FALSE;
+}
+
+
+/*
+ * per-process accounting
+ *
+ * The capture thread only adds the packet length to a per local port
+ * counter and remembers the touched ports. Once a second the resolver
+ * thread takes these deltas and attributes them to the process owning the
+ * port. Ports are mapped to socket inodes with /proc/net/{tcp,udp}{,6} and
+ * inodes to processes by walking /proc/<pid>/fd. This is only repeated on a
+ * lookup miss and at most every PROC_REFRESH_MS, the expensive walk of the
+ * file descriptors only if an inode is not known yet. On links that do not
+ * tell the direction, raw IP of tun devices or PPP, the flows are kept
+ * with both ports and charged to the owner of whichever port is local.
+ */
+
+#define PROC_PORTS 65536
+#define PROC_REFRESH_MS 1000
+#define PROC_PAIRS 4096                 /* flows of unknown direction a tick */
+#define PROC_PID_UNKNOWN 0              /* port without known owner */
+#define PROC_PID_OTHER G_MAXUINT        /* neither TCP nor UDP */
+
+typedef enum { PROC_TCP, PROC_UDP, PROC_PROTOS } proc_proto_t;
+
+typedef struct
+{
+  guint   pid;
+  char    name[32];
+  guint64 bytes[2];               /* TM_SHM_IN, TM_SHM_OUT */
+} proc_total_t;
+
+/* a flow on a link that does not tell the direction: either port may be
+   the local one, the resolver tries both */
+typedef struct
+{
+  guint16 proto;                  /* proc_proto_t */
+  guint16 sport;
+  guint16 dport;
+  guint16 reserved;
+  guint64 bytes;
+} proc_pair_t;
+
+typedef struct
+{
+  GAsyncQueue  *queue;            /* ticks for the resolver */
+  GThread      *thread;
+
+  /* protected by data_mutex */
+  guint64     (*delta)[2];        /* [proto << 16 | port][dir] */
+  guint32      *touched;          /* keys with nonzero delta */
+  unsigned int  ntouched;
+  guint64       other[2];
+  proc_pair_t  *pairs;            /* PROC_PAIRS */
+  unsigned int  npairs;
+  GHashTable   *pair_index;       /* proc_pair_t * of pairs */
+  gboolean      tick_pending;
+
+  /* resolver thread only */
+  guint32      *work;
+  guint64     (*work_bytes)[2];
+  proc_pair_t  *work_pairs;
+  unsigned int  nwork_pairs;
+  gulong       *port_inode;       /* [proto << 16 | port] */
+  GHashTable   *inode_pid;
+  gint64        last_refresh;
+
+  /* protected by mutex, read by the view */
+  GMutex       *mutex;
+  GHashTable   *totals;           /* pid -> proc_total_t */
+} proc_t;
+static proc_t *proc = NULL;
+
+static guint proc_pair_hash(gconstpointer key)
+{
+  const proc_pair_t *a = (const proc_pair_t *)key;
+
+  return ((guint)a->sport << 16 | a->dport) ^ a->proto;
+}
+
+static gboolean proc_pair_equal(gconstpointer key1, gconstpointer key2)
+{
+  const proc_pair_t *a = (const proc_pair_t *)key1;
+  const proc_pair_t *b = (const proc_pair_t *)key2;
+
+  return a->proto == b->proto && a->sport == b->sport && a->dport == b->dport;
+}
+
+/* called with data_mutex held, FALSE if the table of the tick is full */
+static gboolean proc_count_pair(proc_t *p, guint16 proto,
+                                const packet_info_t *pi, unsigned int len)
+{
+  proc_pair_t key;
+  proc_pair_t *a;
+
+  memset(&key, 0, sizeof(key));
+  key.proto = proto;
+  key.sport = pi->sport;
+  key.dport = pi->dport;
+  a = (proc_pair_t *)g_hash_table_lookup(p->pair_index, &key);
+  if (a == NULL) {
+    if (p->npairs == PROC_PAIRS)
+      return FALSE;
+    a = &p->pairs[p->npairs++];
+    *a = key;
+    g_hash_table_insert(p->pair_index, a, a);
+  }
+  a->bytes += len;
+  return TRUE;
+}
+
+/* called with data_mutex held */
+static void proc_count(proc_t *p, const packet_info_t *pi, unsigned int len)
+{
+  guint32 key;
+
+  if (pi->proto == PROTO_TCP)
+    key = PROC_TCP << 16;
+  else if (pi->proto == PROTO_UDP)
+    key = PROC_UDP << 16;
+  else {
+    p->other[pi->dir] += len;
+    return;
+  }
+  if (!pi->dir_known && proc_count_pair(p, key >> 16, pi, len))
+    return;
+  key |= pi->dir == TM_SHM_IN ? pi->dport : pi->sport;
+
+  if (p->delta[key][0] == 0 && p->delta[key][1] == 0)
+    p->touched[p->ntouched++] = key;
+  p->delta[key][pi->dir] += len;
+}
+
+/* called with data_mutex held, once a second */
+static void proc_tick(proc_t *p)
+{
+  if (p == NULL || p->tick_pending)
+    return;
+  if (   p->ntouched == 0 && p->npairs == 0
+      && p->other[0] == 0 && p->other[1] == 0)
+    return;
+  p->tick_pending = TRUE;
+  g_async_queue_push(p->queue, p);
+}
+
+#ifndef WIN32
+
+static void proc_read_net(proc_t *p, const char *path, guint32 proto)
+{
+  char line[512];
+  FILE *f = fopen(path, "r");
+
+  if (f == NULL)
+    return;
+  if (fgets(line, sizeof(line), f) != NULL) { /* skip the title line */
+    while (fgets(line, sizeof(line), f) != NULL) {
+      unsigned int port;
+      unsigned long inode;
+      if (   sscanf(line, "%*d: %*[0-9A-Fa-f]:%x %*[0-9A-Fa-f]:%*x %*x %*s %*s %*s %*u %*u %lu",
+                    &port, &inode) == 2
+          && inode != 0 && port < PROC_PORTS
+          && p->port_inode[proto << 16 | port] == 0)
+        p->port_inode[proto << 16 | port] = inode;
+    }
+  }
+  fclose(f);
+}
+
+static void proc_walk_fds(proc_t *p)
+{
+  DIR *proc_dir = opendir("/proc");
+  struct dirent *pe;
+
+  if (proc_dir == NULL)
+    return;
+
+  g_hash_table_remove_all(p->inode_pid);
+  while ((pe = readdir(proc_dir)) != NULL) {
+    char path[64];
+    char *end;
+    DIR *fd_dir;
+    struct dirent *fe;
+    unsigned long pid = strtoul(pe->d_name, &end, 10);
+
+    if (*end != '\0' || pid == 0)
+      continue;
+    snprintf(path, sizeof(path), "/proc/%lu/fd", pid);
+    fd_dir = opendir(path);
+    if (fd_dir == NULL)
+      continue;
+    while ((fe = readdir(fd_dir)) != NULL) {
+      char link[64];
+      unsigned long inode;
+      ssize_t n;
+
+      if (fe->d_name[0] == '.')
+        continue;
+      n = readlinkat(dirfd(fd_dir), fe->d_name, link, sizeof(link) - 1);
+      if (n <= 0)
+        continue;
+      link[n] = '\0';
+      if (sscanf(link, "socket:[%lu]", &inode) == 1)
+        g_hash_table_insert(p->inode_pid, GUINT_TO_POINTER((guint)inode),
+                            GUINT_TO_POINTER((guint)pid));
+    }
+    closedir(fd_dir);
+  }
+  closedir(proc_dir);
+}
+
+static void proc_name(guint pid, char *name, gsize size)
+{
+  char path[64];
+  FILE *f;
+
+  snprintf(path, sizeof(path), "/proc/%u/comm", pid);
+  f = fopen(path, "r");
+  if (f == NULL || fgets(name, size, f) == NULL)
+    snprintf(name, size, "pid %u", pid);
+  else
+    name[strcspn(name, "\n")] = '\0';
+  if (f != NULL)
+    fclose(f);
+}
+
+#else /* WIN32 */
+
+/* no attribution on Windows yet, everything is unknown */
+static void proc_read_net(proc_t *p, const char *path, guint32 proto)
+{
+}
+
+static void proc_walk_fds(proc_t *p)
+{
+}
+
+static void proc_name(guint pid, char *name, gsize size)
+{
+  g_snprintf(name, size, "pid %u", pid);
+}
+
+#endif /* WIN32 */
+
+static guint proc_lookup(proc_t *p, guint32 key)
+{
+  gulong inode = p->port_inode[key];
+
+  if (inode == 0)
+    return PROC_PID_UNKNOWN;
+  return GPOINTER_TO_UINT(g_hash_table_lookup(p->inode_pid,
+                                              GUINT_TO_POINTER((guint)inode)));
+}
+
+/* the ports of a tick: n keys of known direction, then both ends of the
+   pairs */
+static guint32 proc_work_key(const proc_t *p, unsigned int n, unsigned int i)
+{
+  const proc_pair_t *a;
+
+  if (i < n)
+    return p->work[i];
+  a = &p->work_pairs[(i - n) / 2];
+  return (guint32)a->proto << 16 | ((i - n) % 2 == 0 ? a->dport : a->sport);
+}
+
+/* reread the socket tables, and walk the processes if there is a new inode */
+static void proc_refresh(proc_t *p, unsigned int n)
+{
+  unsigned int i;
+
+  memset(p->port_inode, 0, PROC_PROTOS * PROC_PORTS * sizeof(gulong));
+  proc_read_net(p, "/proc/net/tcp", PROC_TCP);
+  proc_read_net(p, "/proc/net/tcp6", PROC_TCP);
+  proc_read_net(p, "/proc/net/udp", PROC_UDP);
+  proc_read_net(p, "/proc/net/udp6", PROC_UDP);
+
+  for (i = 0; i < n + 2 * p->nwork_pairs; ++i) {
+    gulong inode = p->port_inode[proc_work_key(p, n, i)];
+    if (   inode != 0
+        && g_hash_table_lookup(p->inode_pid, GUINT_TO_POINTER((guint)inode)) == NULL) {
+      proc_walk_fds(p);
+      break;
+    }
+  }
+  p->last_refresh = time_usec();
+}
+
+static void proc_add(proc_t *p, guint pid, const guint64 b[2])
+{
+  proc_total_t *t = (proc_total_t *)g_hash_table_lookup(p->totals,
+                                                        GUINT_TO_POINTER(pid));
+  if (t == NULL) {
+    t = (proc_total_t *)g_malloc0(sizeof(proc_total_t));
+    t->pid = pid;
+    if (pid == PROC_PID_UNKNOWN)
+      g_strlcpy(t->name, "(unknown)", sizeof(t->name));
+    else if (pid == PROC_PID_OTHER)
+      g_strlcpy(t->name, "(not TCP/UDP)", sizeof(t->name));
+    else
+      proc_name(pid, t->name, sizeof(t->name));
+    g_hash_table_insert(p->totals, GUINT_TO_POINTER(pid), t);
+  }
+  t->bytes[0] += b[0];
+  t->bytes[1] += b[1];
+}
+
+static void proc_attribute(proc_t *p)
+{
+  guint64 other[2];
+  gboolean missed = FALSE;
+  gint64 elapsed;
+  unsigned int i, n;
+
+  g_mutex_lock(data_mutex);
+  n = p->ntouched;
+  for (i = 0; i < n; ++i) {
+    guint32 key = p->touched[i];
+    p->work[i] = key;
+    p->work_bytes[i][0] = p->delta[key][0];
+    p->work_bytes[i][1] = p->delta[key][1];
+    p->delta[key][0] = p->delta[key][1] = 0;
+  }
+  p->ntouched = 0;
+  other[0] = p->other[0];
+  other[1] = p->other[1];
+  p->other[0] = p->other[1] = 0;
+  p->nwork_pairs = p->npairs;
+  memcpy(p->work_pairs, p->pairs, p->npairs * sizeof(proc_pair_t));
+  p->npairs = 0;
+  g_hash_table_remove_all(p->pair_index);
+  p->tick_pending = FALSE;
+  g_mutex_unlock(data_mutex);
+
+  for (i = 0; i < n && !missed; ++i)
+    missed = proc_lookup(p, p->work[i]) == PROC_PID_UNKNOWN;
+  for (i = 0; i < p->nwork_pairs && !missed; ++i)
+    missed =    proc_lookup(p, proc_work_key(p, n, n + 2 * i)) == PROC_PID_UNKNOWN
+             && proc_lookup(p, proc_work_key(p, n, n + 2 * i + 1)) == PROC_PID_UNKNOWN;
+  elapsed = time_usec() - p->last_refresh;
+  /* a clock set back must not hold the refresh off */
+  if (missed && (elapsed < 0 || elapsed >= PROC_REFRESH_MS * 1000))
+    proc_refresh(p, n);
+
+  g_mutex_lock(p->mutex);
+  for (i = 0; i < n; ++i)
+    proc_add(p, proc_lookup(p, p->work[i]), p->work_bytes[i]);
+  for (i = 0; i < p->nwork_pairs; ++i) {
+    /* the destination port is local if it is ours, else the source port */
+    guint64 b[2] = { 0, 0 };
+    guint pid = proc_lookup(p, proc_work_key(p, n, n + 2 * i));
+    int dir = TM_SHM_IN;
+
+    if (pid == PROC_PID_UNKNOWN) {
+      pid = proc_lookup(p, proc_work_key(p, n, n + 2 * i + 1));
+      if (pid != PROC_PID_UNKNOWN)
+        dir = TM_SHM_OUT;
+    }
+    b[dir] = p->work_pairs[i].bytes;
+    proc_add(p, pid, b);
+  }
+  if (other[0] != 0 || other[1] != 0)
+    proc_add(p, PROC_PID_OTHER, other);
+  g_mutex_unlock(p->mutex);
+}
+
+static gpointer proc_thread(gpointer data)
+{
+  proc_t *p = (proc_t *)data;
+
+  /* every queue item is a tick, the thread stops once proc is not p */
+  for (;;) {
+    (void) g_async_queue_pop(p->queue);
+    g_mutex_lock(data_mutex);
+    if (proc != p) {
+      g_mutex_unlock(data_mutex);
+      break;
+    }
+    g_mutex_unlock(data_mutex);
+    proc_attribute(p);
+  }
+  return NULL;
 }
 
-static unsigned int history_get_data(history_t *h, unsigned int pos)
+static proc_t * proc_open(void)
 {
-  return h->data[pos];
+  GError *error = NULL;
+  proc_t *p = (proc_t *)g_malloc0(sizeof(proc_t));
+
+  p->delta = (guint64 (*)[2])g_malloc0(PROC_PROTOS * PROC_PORTS * sizeof(*p->delta));
+  p->touched = (guint32 *)g_malloc(PROC_PROTOS * PROC_PORTS * sizeof(guint32));
+  p->work = (guint32 *)g_malloc(PROC_PROTOS * PROC_PORTS * sizeof(guint32));
+  p->work_bytes = (guint64 (*)[2])g_malloc(PROC_PROTOS * PROC_PORTS * sizeof(*p->work_bytes));
+  p->port_inode = (gulong *)g_malloc0(PROC_PROTOS * PROC_PORTS * sizeof(gulong));
+  p->pairs = (proc_pair_t *)g_malloc(PROC_PAIRS * sizeof(proc_pair_t));
+  p->work_pairs = (proc_pair_t *)g_malloc(PROC_PAIRS * sizeof(proc_pair_t));
+  p->pair_index = g_hash_table_new(proc_pair_hash, proc_pair_equal);
+  p->inode_pid = g_hash_table_new(g_direct_hash, g_direct_equal);
+  p->totals = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  p->mutex = g_mutex_new();
+  p->queue = g_async_queue_new();
+  p->last_refresh = time_usec() - PROC_REFRESH_MS * 1000;
+
+  p->thread = g_thread_create(&proc_thread, p, TRUE, &error);
+  if (p->thread == NULL) {
+    g_printerr("Failed to create process accounting thread: %s\n", error->message);
+    g_error_free(error);
+    p->thread = NULL;
+  }
+  return p;
 }
 
-static void history_add(history_t *h, unsigned int v)
+/* call without data_mutex held, after proc has been set to NULL under it */
+static void proc_close(proc_t *p)
 {
-  unsigned int old = h->data[h->tail];
-
-  h->data[h->tail] = v;
-  
-  if (h->max > 0 && old == h->max) {
-    int x = 0;
-    h->max = 0;
-    for (x = 0; x < h->size; ++x)
-      if (h->data[x] > h->max)
-        h->max = h->data[x];
+  if (p == NULL)
+    return;
+  if (p->thread != NULL) {
+    g_async_queue_push(p->queue, p);
+    g_thread_join(p->thread);
   }
-
-  if (++h->tail == h->size) h->tail = 0;
-  if (h->tail == h->head)
-   if (++h->head == h->size)
-     h->head = 0;
-
-  if (v > h->max) h->max = v;
+  g_async_queue_unref(p->queue);
+  g_hash_table_destroy(p->totals);
+  g_hash_table_destroy(p->inode_pid);
+  g_mutex_free(p->mutex);
+  g_free(p->port_inode);
+  g_hash_table_destroy(p->pair_index);
+  g_free(p->work_pairs);
+  g_free(p->pairs);
+  g_free(p->work_bytes);
+  g_free(p->work);
+  g_free(p->touched);
+  g_free(p->delta);
+  g_free(p);
 }
 
-
-/* Configuration globals */
-typedef enum { UNIT_AUTO
-             , UNIT_BYTE
-             , UNIT_KBYTE
-             , UNIT_MBYTE
-             , UNIT_GBYTE
-             } unit_t;
-unit_t unit = UNIT_AUTO;
-unsigned long long bytes = 0;
-gboolean started = FALSE;
-unsigned long long soft_limit = SOFT_LIMIT;
-unsigned long long hard_limit = HARD_LIMIT;
-static unsigned int bytes_since_last_tmo = 0;
-GMutex* data_mutex = NULL; /* protects configuration globals and other shared data */
-
-void update_counter_label(gboolean from_thread);
-
 void error_dialog (gchar *text, gboolean from_thread)
 {
   GtkWidget *dialog =
@@ -248,11 +4627,16 @@ static gboolean graph_expose_event (GtkWidget      *widget,
 {
   cairo_t *cr;
   unsigned int n = 0;
-  unsigned int pos = history_get_head_pos(history);
-  const unsigned int max = history_get_max(history);
+  unsigned int pos;
+  unsigned int max;
   GtkAllocation allocation;
   gtk_widget_get_allocation (widget, &allocation);
 
+  wakeup_count (TM_SHM_WAKEUP_REDRAW);
+  history_flush (history);
+  pos = history_get_head_pos(history);
+  max = history_get_max(history);
+
   cr = gdk_cairo_create (gtk_widget_get_window (widget));
   cairo_rectangle (cr, 0, 0, allocation.width, allocation.height);
   cairo_set_source_rgb(cr, 1, 1, 1);
@@ -293,6 +4677,9 @@ static gboolean graph_expose_event (GtkWidget      *widget,
 static gboolean timer_handler (GtkWidget *widget)
 {
   gboolean restart_timer;
+  quota_event_t events[QUOTA_MAX];
+  unsigned int nevents;
+  gboolean redraw;
   GdkRectangle update_rect;
   GtkAllocation allocation;
   gtk_widget_get_allocation (widget, &allocation);
@@ -303,11 +4690,19 @@ static gboolean timer_handler (GtkWidget *widget)
 
   g_mutex_lock (data_mutex);
 
-  g_print ("timer_handler entering (widget = %p, bytes_since_last_tmo = %u, width = %u, height = %u)\n",
-           widget, bytes_since_last_tmo, allocation.width, allocation.height);
-
-
+  wakeup_count(TM_SHM_WAKEUP_TIMER);
+  /* a graph that was and stays flat does not change */
+  redraw = !history_blank(history);
   history_add(history, bytes_since_last_tmo);
+  redraw = redraw || !history_blank(history);
+  journal_append(journal, JOURNAL_SAMPLE, bytes_since_last_tmo, bytes, dev);
+  shm_push_second(bytes_since_last_tmo);
+  rate_stats_second(&stats, bytes_since_last_tmo, time(NULL));
+  shm_push_stats(&stats);
+  proc_tick(proc);
+  nevents = quota_tick(time(NULL), events);
+  wakeup_tick();
+  shm_push_power();
 
   bytes_since_last_tmo = 0;
 
@@ -315,7 +4710,16 @@ static gboolean timer_handler (GtkWidget *widget)
 
   g_mutex_unlock (data_mutex);
 
-  gdk_window_invalidate_rect (gtk_widget_get_window (widget), &update_rect, FALSE);
+  if (nevents > 0) {
+    quota_act(events, nevents);
+    update_counter_label(FALSE);
+  }
+
+  /* nobody looks at a hidden or iconified window, it is drawn when shown */
+  if (redraw && gtk_widget_get_visible (window)
+      && !(gdk_window_get_state (gtk_widget_get_window (window))
+           & GDK_WINDOW_STATE_ICONIFIED))
+    gdk_window_invalidate_rect (gtk_widget_get_window (widget), &update_rect, FALSE);
 
   return restart_timer; /* do not stop timer if started */
 }
@@ -366,13 +4770,264 @@ static void set_unit( gpointer   data,
 
   g_mutex_unlock (data_mutex);
 
+  checkpoint_request (checkpoint);
   update_counter_label (FALSE);
 }
 
+static void device_changed(GtkComboBox *widget, gpointer data)
+{
+  gchar *name = gtk_combo_box_get_active_text (widget);
+
+  if (name == NULL)
+    return;
+  if (data_mutex) g_mutex_lock (data_mutex);
+  g_strlcpy (device_name, name, sizeof(device_name));
+  device_ifindex = iface_index (name);
+  if (data_mutex) g_mutex_unlock (data_mutex);
+  g_free (name);
+
+  checkpoint_request (checkpoint);
+}
+
+/* per-process view, a sortable list refreshed while it is open */
+
+enum { PROC_COL_PID
+     , PROC_COL_NAME
+     , PROC_COL_IN
+     , PROC_COL_OUT
+     , PROC_COL_TOTAL
+     , PROC_COLS
+     };
+
+static GtkListStore *proc_store = NULL;
+static guint proc_view_timer = 0;
+
+static void proc_view_fill(gpointer key, gpointer value, gpointer data)
+{
+  const proc_total_t *t = (const proc_total_t *)value;
+  GtkTreeIter iter;
+
+  gtk_list_store_append (proc_store, &iter);
+  gtk_list_store_set (proc_store, &iter,
+                      PROC_COL_PID, t->pid == PROC_PID_OTHER ? 0 : t->pid,
+                      PROC_COL_NAME, t->name,
+                      PROC_COL_IN, t->bytes[TM_SHM_IN],
+                      PROC_COL_OUT, t->bytes[TM_SHM_OUT],
+                      PROC_COL_TOTAL, t->bytes[TM_SHM_IN] + t->bytes[TM_SHM_OUT],
+                      -1);
+}
+
+static gboolean proc_view_update(gpointer data)
+{
+  gtk_list_store_clear (proc_store);
+  if (proc != NULL) {
+    g_mutex_lock (proc->mutex);
+    g_hash_table_foreach (proc->totals, proc_view_fill, NULL);
+    g_mutex_unlock (proc->mutex);
+  }
+  return TRUE;
+}
+
+static void proc_view_destroy(GtkWidget *widget, gpointer data)
+{
+  g_source_remove (proc_view_timer);
+  proc_view_timer = 0;
+  g_object_unref (proc_store);
+  proc_store = NULL;
+}
+
+static void proc_view_column(GtkWidget *view, const gchar *title, gint col)
+{
+  GtkCellRenderer *renderer = gtk_cell_renderer_text_new ();
+  GtkTreeViewColumn *column =
+    gtk_tree_view_column_new_with_attributes (title, renderer, "text", col, NULL);
+
+  gtk_tree_view_column_set_sort_column_id (column, col);
+  gtk_tree_view_append_column (GTK_TREE_VIEW (view), column);
+}
+
+static void show_processes(gpointer data, GtkWidget *widget)
+{
+  GtkWidget *proc_window;
+  GtkWidget *scrolled;
+  GtkWidget *view;
+
+  if (proc_store != NULL)
+    return;
+
+  if (!proc_accounting) {
+    GtkWidget *dialog =
+      gtk_message_dialog_new (GTK_WINDOW (window),
+                              GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                              GTK_MESSAGE_INFO, GTK_BUTTONS_OK, "%s",
+                              "Per-process accounting is off, "
+                              "enable it in the Settings menu.");
+    gtk_dialog_run (GTK_DIALOG (dialog));
+    gtk_widget_destroy (dialog);
+    return;
+  }
+
+  proc_store = gtk_list_store_new (PROC_COLS, G_TYPE_UINT, G_TYPE_STRING,
+                                   G_TYPE_UINT64, G_TYPE_UINT64, G_TYPE_UINT64);
+  gtk_tree_sortable_set_sort_column_id (GTK_TREE_SORTABLE (proc_store),
+                                        PROC_COL_TOTAL, GTK_SORT_DESCENDING);
+
+  proc_window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+  gtk_window_set_title (GTK_WINDOW (proc_window), "Processes");
+  gtk_window_set_default_size (GTK_WINDOW (proc_window), 420, 300);
+  g_signal_connect (G_OBJECT (proc_window), "destroy",
+                    G_CALLBACK (proc_view_destroy), NULL);
+
+  scrolled = gtk_scrolled_window_new (NULL, NULL);
+  gtk_scrolled_window_set_policy (GTK_SCROLLED_WINDOW (scrolled),
+                                  GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+  gtk_container_add (GTK_CONTAINER (proc_window), scrolled);
+
+  view = gtk_tree_view_new_with_model (GTK_TREE_MODEL (proc_store));
+  proc_view_column (view, "PID", PROC_COL_PID);
+  proc_view_column (view, "Process", PROC_COL_NAME);
+  proc_view_column (view, "In [Byte]", PROC_COL_IN);
+  proc_view_column (view, "Out [Byte]", PROC_COL_OUT);
+  proc_view_column (view, "Total [Byte]", PROC_COL_TOTAL);
+  gtk_container_add (GTK_CONTAINER (scrolled), view);
+
+  proc_view_update (NULL);
+  proc_view_timer = g_timeout_add_seconds (2, proc_view_update, NULL);
+  gtk_widget_show_all (proc_window);
+}
+
+/* statistics view, refreshed every second while it is open */
+
+static GtkWidget *stats_label = NULL;
+static guint stats_view_timer = 0;
+
+static const char * stats_rate_text(char *text, gsize size, double rate)
+{
+  double bits = rate * 8.0;
+
+  if (bits < 1000.0)
+    g_snprintf(text, size, "%.0f bit/s", bits);
+  else if (bits < 1000000.0)
+    g_snprintf(text, size, "%.2f kbit/s", bits / 1000.0);
+  else if (bits < 1000000000.0)
+    g_snprintf(text, size, "%.2f Mbit/s", bits / 1000000.0);
+  else
+    g_snprintf(text, size, "%.2f Gbit/s", bits / 1000000000.0);
+  return text;
+}
+
+static gboolean stats_view_update(gpointer data)
+{
+  static const char *size_name[PKT_SIZES] =
+    { "up to 64", "65-127", "128-255", "256-511", "512-1023", "1024-1518",
+      "above 1518" };
+  rate_stats_t st;
+  tm_shm_power_t pw;
+  guint64 packets = 0;
+  GString *text;
+  char r[8][32];
+  int i;
+
+  g_mutex_lock (data_mutex);
+  st = stats;
+  pw = power;
+  g_mutex_unlock (data_mutex);
+
+  text = g_string_new (NULL);
+  g_string_append_printf (text,
+    "Elapsed:\t\t\t%llu:%02u:%02u\n"
+    "Average speed:\t\t%s\n"
+    "Current speed:\t\t%s\n"
+    "Last 1 / 5 / 15 min:\t%s / %s / %s\n"
+    "Seconds p50 / p95 / p99:\t%s / %s / %s\n\n"
+    "Packet sizes [Byte]\n",
+    (unsigned long long)(st.seconds / 3600),
+    (unsigned int)(st.seconds / 60 % 60), (unsigned int)(st.seconds % 60),
+    stats_rate_text (r[0], sizeof(r[0]),
+                     st.seconds > 0 ? (double)st.bytes / st.seconds : 0.0),
+    stats_rate_text (r[1], sizeof(r[1]), st.last),
+    stats_rate_text (r[2], sizeof(r[2]), st.ewma.rate[0]),
+    stats_rate_text (r[3], sizeof(r[3]), st.ewma.rate[1]),
+    stats_rate_text (r[4], sizeof(r[4]), st.ewma.rate[2]),
+    stats_rate_text (r[5], sizeof(r[5]), rate_hist_percentile (&st.hist, 50)),
+    stats_rate_text (r[6], sizeof(r[6]), rate_hist_percentile (&st.hist, 95)),
+    stats_rate_text (r[7], sizeof(r[7]), rate_hist_percentile (&st.hist, 99)));
+
+  for (i = 0; i < PKT_SIZES; ++i)
+    packets += st.sizes[i];
+  for (i = 0; i < PKT_SIZES; ++i)
+    g_string_append_printf (text, "  %s:\t\t%llu (%.1f%%)\n", size_name[i],
+                            (unsigned long long)st.sizes[i],
+                            packets > 0 ? 100.0 * st.sizes[i] / packets : 0.0);
+
+  g_string_append_printf (text,
+    "\nWakeups per minute\n"
+    "  timer / capture / redraw:\t%u / %u / %u\n"
+    "CPU time:\t\t\t%.2f s\n",
+    pw.per_minute[TM_SHM_WAKEUP_TIMER], pw.per_minute[TM_SHM_WAKEUP_CAPTURE],
+    pw.per_minute[TM_SHM_WAKEUP_REDRAW], pw.cpu_usec / 1e6);
+
+  gtk_label_set_text (GTK_LABEL (stats_label), text->str);
+  g_string_free (text, TRUE);
+  return TRUE;
+}
+
+static void stats_view_destroy(GtkWidget *widget, gpointer data)
+{
+  g_source_remove (stats_view_timer);
+  stats_view_timer = 0;
+  stats_label = NULL;
+}
+
+static void show_statistics(gpointer data, GtkWidget *widget)
+{
+  GtkWidget *stats_window;
+
+  if (stats_label != NULL)
+    return;
+
+  stats_window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+  gtk_window_set_title (GTK_WINDOW (stats_window), "Statistics");
+  gtk_container_set_border_width (GTK_CONTAINER (stats_window), 10);
+  g_signal_connect (G_OBJECT (stats_window), "destroy",
+                    G_CALLBACK (stats_view_destroy), NULL);
+
+  stats_label = gtk_label_new (NULL);
+  gtk_misc_set_alignment (GTK_MISC (stats_label), 0.0, 0.0);
+  gtk_container_add (GTK_CONTAINER (stats_window), stats_label);
+
+  stats_view_update (NULL);
+  stats_view_timer = g_timeout_add_seconds (1, stats_view_update, NULL);
+  gtk_widget_show_all (stats_window);
+}
+
 /*
  * SETTINGS callbacks
  */
 
+static void set_proc_accounting(GtkCheckMenuItem *item, gpointer data)
+{
+  proc_t *old = NULL;
+  gboolean on = gtk_check_menu_item_get_active (item);
+
+  g_mutex_lock (data_mutex);
+  proc_accounting = on;
+  if (!on) {
+    old = proc;
+    proc = NULL;
+  }
+  g_mutex_unlock (data_mutex);
+
+  if (on && proc == NULL) {
+    proc_t *p = proc_open ();
+    g_mutex_lock (data_mutex);
+    proc = p;
+    g_mutex_unlock (data_mutex);
+  }
+  proc_close (old);
+  checkpoint_request (checkpoint);
+}
+
 static void set_limits(gpointer data, GtkWidget *widget)
 {
   gint response;
@@ -428,7 +5083,10 @@ static void set_limits(gpointer data, GtkWidget *widget)
     } else {
       soft_limit = limit;
     }
+    quota_counter_changed();
+    shm_publish();
     g_mutex_unlock (data_mutex);
+    checkpoint_request (checkpoint);
   }
 
   gtk_widget_destroy (dialog);
@@ -508,10 +5166,12 @@ void update_counter_label(gboolean from_thread)
 
   if (from_thread) gdk_threads_enter();
 
-  if (bytes > hard_limit) {
+  if (quota_colour == TM_SHM_LIMIT_HARD) {
     gtk_info_bar_set_message_type (GTK_INFO_BAR (bar), GTK_MESSAGE_ERROR);
-  } else if (bytes > soft_limit) {
+  } else if (quota_colour == TM_SHM_LIMIT_SOFT) {
     gtk_info_bar_set_message_type (GTK_INFO_BAR (bar), GTK_MESSAGE_WARNING);
+  } else {
+    gtk_info_bar_set_message_type (GTK_INFO_BAR (bar), GTK_MESSAGE_INFO);
   }
 
   gtk_status_icon_set_tooltip_text (tray_icon, traytext);
@@ -522,12 +5182,197 @@ void update_counter_label(gboolean from_thread)
 }
 
 
+/*
+ * capture cadence
+ *
+ * Once the kernel buffer is drained, the counter thread pauses before it
+ * waits for the next packet, so that packets are taken in batches rather
+ * than with a wakeup each. The pause is the time the current rate needs to
+ * fill CAPTURE_BUDGET bytes of the buffer, at most CAPTURE_DELAY_MAX_MS,
+ * which is also the pcap read timeout; without traffic the thread sleeps
+ * until a packet arrives or the capture is stopped through capture_wake,
+ * polling the pcap fd and a pipe, or on Windows waiting for the event of
+ * the driver and one of our own.
+ */
+
+#define CAPTURE_BUDGET (256 * 1024)
+#define CAPTURE_DELAY_MAX_MS 100
+
+typedef struct
+{
+  GTimeVal last;                  /* of the last wakeup */
+  guint64  bytes;                 /* captured since then */
+} capture_cadence_t;
+
+#ifdef WIN32
+static HANDLE capture_wake = NULL;        /* auto-reset, set to stop the wait */
+#else /* !WIN32 */
+static int capture_wake[2] = { -1, -1 };  /* pipe, a byte stops the wait */
+#endif /* !WIN32 */
+
+static pcap_t * counter_open(const char *name, char *errbuf)
+{
+  pcap_t *handle = pcap_open_live(name, BUFSIZ, 1, CAPTURE_DELAY_MAX_MS, errbuf);
+
+  if (handle != NULL && pcap_setnonblock(handle, 1, errbuf) != 0) {
+    pcap_close(handle);
+    handle = NULL;
+  }
+#ifdef WIN32
+  /* the driver signals its event from the first packet on */
+  if (handle != NULL)
+    pcap_setmintocopy(handle, 1);
+#endif /* WIN32 */
+  return handle;
+}
+
+static void counter_wake_open(void)
+{
+#ifdef WIN32
+  capture_wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (capture_wake == NULL)
+    g_print("capture wakeup event cannot be created\n");
+#else /* !WIN32 */
+  if (pipe(capture_wake) != 0) {
+    g_print("capture wakeup pipe cannot be created\n");
+    capture_wake[0] = capture_wake[1] = -1;
+    return;
+  }
+  fcntl(capture_wake[0], F_SETFL, fcntl(capture_wake[0], F_GETFL) | O_NONBLOCK);
+  fcntl(capture_wake[1], F_SETFL, fcntl(capture_wake[1], F_GETFL) | O_NONBLOCK);
+#endif /* !WIN32 */
+}
+
+/* wake the counter thread, called after started or capture_gen changed */
+static void counter_wake(void)
+{
+#ifdef WIN32
+  if (capture_wake != NULL)
+    SetEvent(capture_wake);
+#else /* !WIN32 */
+  if (capture_wake[1] >= 0 && write(capture_wake[1], "", 1) < 0)
+    g_print("capture wakeup lost\n");
+#endif /* !WIN32 */
+}
+
+static void counter_wait(pcap_t *handle, capture_cadence_t *c)
+{
+  GTimeVal now;
+  gint64 elapsed;
+  guint64 delay = 0;
+
+  g_get_current_time(&now);
+  elapsed = (gint64)(now.tv_sec - c->last.tv_sec) * G_USEC_PER_SEC
+          + now.tv_usec - c->last.tv_usec;
+  if (c->bytes > 0 && elapsed > 0) {
+    delay = (guint64)CAPTURE_BUDGET * elapsed / c->bytes;
+    delay = MIN(delay, CAPTURE_DELAY_MAX_MS * 1000);
+  }
+  if (delay > 0)
+    g_usleep(delay);
+
+#ifdef WIN32
+  {
+    HANDLE events[2];
+    DWORD n = 0;
+
+    events[n++] = pcap_getevent(handle);
+    if (capture_wake != NULL)
+      events[n++] = capture_wake;
+    /* without the stop event a stop waits for at most the read timeout */
+    WaitForMultipleObjects(n, events, FALSE,
+                           n == 2 ? INFINITE : CAPTURE_DELAY_MAX_MS);
+  }
+#else /* !WIN32 */
+  {
+    struct pollfd fds[2];
+    int timeout;
+
+    fds[0].fd = pcap_get_selectable_fd(handle);
+    fds[0].events = POLLIN;
+    fds[1].fd = capture_wake[0];
+    fds[1].events = POLLIN;
+    /* poll as often as the read timeout if either cannot be waited for */
+    timeout = fds[0].fd >= 0 && fds[1].fd >= 0 ? -1 : CAPTURE_DELAY_MAX_MS;
+    if (poll(fds, 2, timeout) > 0 && (fds[1].revents & POLLIN)) {
+      char buf[16];
+      while (read(capture_wake[0], buf, sizeof(buf)) > 0)
+        ;
+    }
+  }
+#endif /* !WIN32 */
+
+  wakeup_count(TM_SHM_WAKEUP_CAPTURE);
+  g_get_current_time(&c->last);
+  c->bytes = 0;
+}
+
+/* counter thread: after the interface of dev went away, wait until it can
+   be opened again; NULL if the capture is stopped meanwhile */
+static pcap_t * counter_reattach(guint gen, char *errbuf)
+{
+  pcap_t *handle = NULL;
+  char text[DEVICE_NAME_LEN + 32];
+
+  g_snprintf(text, sizeof(text), "Waiting for %s ...", dev);
+  gdk_threads_enter();
+  gtk_statusbar_pop (GTK_STATUSBAR (statusbar), context_id);
+  (void)gtk_statusbar_push (GTK_STATUSBAR (statusbar), context_id, text);
+  gdk_threads_leave();
+
+  g_mutex_lock (data_mutex);
+  shm_set_iface(dev, FALSE);
+  while (handle == NULL && started && gen == capture_gen) {
+    GTimeVal tv;
+    g_get_current_time (&tv);
+    g_time_val_add (&tv, IFACE_RETRY_SEC * G_USEC_PER_SEC);
+    g_cond_timed_wait (iface_cond, data_mutex, &tv);
+    if (!started || gen != capture_gen)
+      break;
+    g_mutex_unlock (data_mutex);
+    handle = counter_open(dev, errbuf);
+    g_mutex_lock (data_mutex);
+  }
+  if (handle != NULL && (!started || gen != capture_gen)) {
+    pcap_close(handle);
+    handle = NULL;
+  }
+  if (handle != NULL) {
+    shm_set_iface(dev, TRUE);
+    if (strcmp(device_name, dev) == 0 && device_ifindex != iface_index(dev)) {
+      device_ifindex = iface_index(dev);
+      checkpoint_request (checkpoint);
+    }
+  }
+  g_mutex_unlock (data_mutex);
+
+  if (handle != NULL) {
+    g_snprintf(text, sizeof(text), "Reattached to %s", dev);
+    gdk_threads_enter();
+    gtk_statusbar_pop (GTK_STATUSBAR (statusbar), context_id);
+    (void)gtk_statusbar_push (GTK_STATUSBAR (statusbar), context_id, text);
+    gdk_threads_leave();
+  }
+  return handle;
+}
+
 static void *counter(void *arg)
 {
   char errbuf[PCAP_ERRBUF_SIZE];
-  struct pcap_pkthdr header;	/* The header that pcap gives us */
+  struct pcap_pkthdr *header;	/* The header that pcap gives us */
 	const u_char *packet;		/* The actual packet */
   pcap_t *handle = NULL;
+  int linktype;
+  guint8 mac[6];
+  gboolean have_mac;
+  struct pcap_stat ps;
+  gboolean have_stats = FALSE;
+  long stats_sec = 0;
+  long label_sec = 0;
+  gboolean label_pending = FALSE;
+  capture_cadence_t cadence;
+  dedup_t *dd = NULL;
+  guint gen;
   dev = gtk_combo_box_get_active_text (GTK_COMBO_BOX (combo));
 
   if (dev == NULL) {
@@ -544,7 +5389,17 @@ static void *counter(void *arg)
     g_thread_exit (NULL);
   }
 
-  handle = pcap_open_live(dev, BUFSIZ, 1, 0, errbuf);
+  g_mutex_lock (data_mutex);
+  gen = capture_gen;
+  g_mutex_unlock (data_mutex);
+
+  handle = counter_open(dev, errbuf);
+  if (handle == NULL && iface_missing(dev)) {
+    /* not plugged in yet, it is counted as soon as it appears */
+    handle = counter_reattach(gen, errbuf);
+    if (handle == NULL)
+      g_thread_exit (NULL);
+  }
   if (handle == NULL) {
     fprintf(stderr, "Couldn't open device %s: %s\n", dev, errbuf);
     g_mutex_lock (data_mutex);
@@ -553,28 +5408,104 @@ static void *counter(void *arg)
     return NULL;
   }
   g_print("handle = %p\n", handle);
+  linktype = pcap_datalink(handle);
+  have_mac = iface_hwaddr(dev, mac);
+
+  g_mutex_lock (data_mutex);
+  shm_set_iface(dev, TRUE);
+  if (dedup_wanted(linktype))
+    dd = dedup_new();
+  g_mutex_unlock (data_mutex);
+
+  memset(&cadence, 0, sizeof(cadence));
+  g_get_current_time(&cadence.last);
 
   for (;;) {
-    packet = pcap_next(handle, &header);
+    packet_info_t pi;
+    gboolean dup;
+    int res;
+
+    res = pcap_next_ex(handle, &header, &packet);
+    if (res < 0) {
+      /* the interface is gone or down, reattach when it is back */
+      fprintf(stderr, "Capture on %s stopped: %s\n", dev, pcap_geterr(handle));
+      pcap_close(handle);
+      handle = counter_reattach(gen, errbuf);
+      if (handle == NULL) {
+        dedup_free(dd);
+        g_thread_exit (NULL);
+      }
+      linktype = pcap_datalink(handle);
+      have_mac = iface_hwaddr(dev, mac);
+      dedup_free(dd);
+      g_mutex_lock (data_mutex);
+      dd = dedup_wanted(linktype) ? dedup_new() : NULL;
+      g_mutex_unlock (data_mutex);
+      continue;
+    }
+    if (res == 0)
+      packet = NULL;
+
+    dup = FALSE;
+    if (packet != NULL) {
+      packet_parse(linktype, packet, header->caplen, header->len,
+                   have_mac ? mac : NULL, &pi);
+      dup = dd != NULL && dedup_seen(dd, &pi, &header->ts);
+    }
+
+    /* drop counters once a second, pcap_stats() is a system call */
+    if (packet != NULL && header->ts.tv_sec != stats_sec) {
+      stats_sec = header->ts.tv_sec;
+      have_stats = pcap_stats(handle, &ps) == 0;
+    }
 
     g_mutex_lock (data_mutex);
-    if (!started) {
+    if (!started || gen != capture_gen) {
       g_mutex_unlock (data_mutex);
       pcap_close(handle);
+      dedup_free(dd);
       g_thread_exit (NULL);
     }
-    bytes += header.len;
-    if (bytes > hard_limit) {
-      g_print ("DEBUG: beyond hard limit\n");
-    } else if (bytes > soft_limit) {
-      g_print ("DEBUG: beyond soft limit\n");
+    if (packet == NULL) {
+      g_mutex_unlock (data_mutex);
+      /* drained: show the batch, then pause and wait for the next one */
+      if (label_pending) {
+        update_counter_label(TRUE);
+        label_pending = FALSE;
+      }
+      counter_wait(handle, &cadence);
+      continue;
+    }
+    if (dup) {
+      shm_count_dup(header->len);
+      g_mutex_unlock (data_mutex);
+      continue;
+    }
+    bytes += header->len;
+    quota_total += header->len;
+    if (quota_total >= quota_next)
+      quota_update();
+    bytes_since_last_tmo += header->len;
+    rate_stats_packet(&stats, header->len);
+    shm_count_packet(pi.dir, header->len, &header->ts,
+                     pi.tunnel, pi.tunnel_id, pi.inner_len);
+    if (proc != NULL)
+      proc_count(proc, &pi, header->len);
+    if (have_stats) {
+      shm_set_drops(&ps);
+      have_stats = FALSE;
     }
-    bytes_since_last_tmo += header.len;
     g_mutex_unlock (data_mutex);
 
-    g_print("packet captured: len = %u\n", header.len);
-
-    update_counter_label(TRUE);
+    /* the display follows once per batch, and once a second in long ones */
+    cadence.bytes += header->len;
+    if (header->ts.tv_sec != label_sec) {
+      label_sec = header->ts.tv_sec;
+      update_counter_label(TRUE);
+      label_pending = FALSE;
+    } else {
+      label_pending = TRUE;
+    }
   }
 
   g_print("after pcap_loop\n");
@@ -587,30 +5518,34 @@ static void *counter(void *arg)
 static void start(GtkWidget *widget, gpointer data)
 {
   GError *error = NULL;
-  time_t t = time(NULL);
 
   if (started) {
     g_print( "stop counting\n");
     gtk_label_set_text( GTK_LABEL (button_label), "Start");
     g_mutex_lock (data_mutex);
     started = FALSE;
+    g_cond_broadcast (iface_cond);
+    shm_set_iface(NULL, FALSE);
+    shm_publish();
     g_mutex_unlock (data_mutex);
+    counter_wake ();
+    quota_tick_now ();
 	  gtk_widget_set_sensitive (combo, TRUE);
-    (void) fprintf (log_file, "%s\tSTOP: bytes = %llu\n",
-                    asctime(localtime(&t)), bytes);
+    journal_append (journal, JOURNAL_STOP, 0, bytes, dev);
   } else {
     g_print( "start counting\n");
     gtk_statusbar_pop (GTK_STATUSBAR (statusbar), context_id);
     (void)gtk_statusbar_push (GTK_STATUSBAR (statusbar), context_id, "Started");
-    g_timeout_add (1000, (GSourceFunc)timer_handler, (gpointer) graph);
+    g_timeout_add_seconds (1, (GSourceFunc)timer_handler, (gpointer) graph);
     gtk_label_set_text( GTK_LABEL (button_label), "Stop");
     g_mutex_lock (data_mutex);
     started = TRUE;
+    ++capture_gen;
+    shm_publish();
     g_mutex_unlock (data_mutex);
     gtk_widget_set_sensitive (combo, FALSE);
 
-    (void) fprintf (log_file, "%s\tSTART: bytes = %llu\n",
-                    asctime(localtime(&t)), bytes);
+    journal_append (journal, JOURNAL_START, 0, bytes, dev);
 
     if (!g_thread_create(&counter, NULL, FALSE, &error)) {
       g_printerr ("Failed to create counter thread: %s\n", error->message);
@@ -620,21 +5555,23 @@ static void start(GtkWidget *widget, gpointer data)
 
 static gboolean reset(GtkWidget *widget, GdkEvent *event, gpointer data)
 {
-  time_t t = time(NULL);
-
   g_mutex_lock (data_mutex);
   bytes = 0;
+  quota_counter_changed();
+  shm_clear_history();
+  rate_stats_clear(&stats);
+  shm_push_stats(&stats);
+  shm_publish();
   g_mutex_unlock (data_mutex);
   
   history_clr(history);
 
-  (void) fprintf (log_file, "%s\tRESET: bytes = %llu\n",
-                  asctime(localtime(&t)), bytes);
+  journal_append (journal, JOURNAL_RESET, 0, bytes, dev);
+  checkpoint_request (checkpoint);
 
   gtk_statusbar_pop (GTK_STATUSBAR (statusbar), context_id);
   (void)gtk_statusbar_push (GTK_STATUSBAR (statusbar), context_id, "Counter reset");
 
-  gtk_info_bar_set_message_type (GTK_INFO_BAR (bar), GTK_MESSAGE_INFO);
   if (dev != NULL)
     update_counter_label(FALSE);
 
@@ -644,28 +5581,15 @@ static gboolean reset(GtkWidget *widget, GdkEvent *event, gpointer data)
 
 static gboolean delete_event(GtkWidget *widget, GdkEvent *event, gpointer data)
 {
-  FILE *f;
-  time_t t = time(NULL);
-
   if (chdir(getenv("HOME"))) {
     g_print("Unable to change directory to %s\n", getenv("HOME"));
   }
-  f = fopen (RCNAME, "w+");
-  if (f == NULL) {
-    error_dialog("Unable to open .trcntrc file "
+  journal_append (journal, JOURNAL_QUIT, 0, bytes, dev);
+  if (!checkpoint_close (checkpoint)) {
+    error_dialog("Unable to write " RCNAME " file "
                  "and save any changes.", FALSE);
-  } else {
-    gint ifx = gtk_combo_box_get_active (GTK_COMBO_BOX (combo));
-    fprintf (f, "bytes=%llu\n", bytes);
-    fprintf (f, "unit=%u\n", unit);
-    fprintf (f, "device=%d\n", ifx < 0 ? 0 : ifx);
-    fprintf (f, "softlimit=%llu\n", soft_limit);
-    fprintf (f, "hardlimit=%llu\n", hard_limit);
-    fclose (f);
   }
-  (void) fprintf (log_file, "%s\tQUIT: bytes = %llu\n",
-                  asctime(localtime(&t)), bytes);
-  fclose (log_file);
+  checkpoint = NULL;
   gtk_main_quit ();
   return FALSE;
 }
@@ -682,38 +5606,60 @@ int main(int argc, char *argv[])
   GSList *group;
   GtkWidget *tray_menu, *tray_menu_item_show, *tray_menu_item_quit;
   GtkWidget *frame = NULL;
+  proc_t *old_proc;
 
-  pcap_if_t *iface = NULL;
-  pcap_if_t *iflst = NULL;
-  char errbuf[PCAP_ERRBUF_SIZE];
-  gint ifx = 0;
   FILE *f = NULL;
 
   /* read configuration */
   if (chdir(getenv("HOME"))) {
     g_print("Unable to change directory to %s\n", getenv("HOME"));
   }
+
+  /* command line tools working on the stored history, no GUI needed */
+  if (argc > 1 && strcmp (argv[1], "--dump") == 0)
+    return journal_dump (argc - 2, argv + 2);
+  if (argc > 1 && strcmp (argv[1], "--watch") == 0)
+    return shm_watch (argc - 2, argv + 2);
+  if (argc > 1 && strcmp (argv[1], "--replay") == 0)
+    return packet_replay (argc - 2, argv + 2);
+  if (argc > 1 && strcmp (argv[1], "--report") == 0) {
+    g_thread_init(NULL);
+    return report_main (argc - 2, argv + 2);
+  }
+
   f = fopen (RCNAME, "r");
   if (f) {
     fscanf (f, "bytes=%llu\n", &bytes);
     fscanf (f, "unit=%u\n", &unit);
-    fscanf (f, "device=%d\n", &ifx);
-    if (ifx < 0) ifx = 0;
+    fscanf (f, "device=%127s\n", device_name);
+    if (fscanf (f, "ifindex=%u\n", &device_ifindex) != 1)
+      iface_legacy (device_name);
     fscanf (f, "softlimit=%llu\n", &soft_limit);
     fscanf (f, "hardlimit=%llu\n", &hard_limit);
+    fscanf (f, "journalsync=%u\n", &journal_sync);
+    fscanf (f, "checkpoint=%u\n", &checkpoint_interval);
+    fscanf (f, "checkpointsync=%u\n", &checkpoint_sync);
+    fscanf (f, "generation=%u\n", &rc_generation);
+    fscanf (f, "metrics=%107s\n", metrics_spec);
+    fscanf (f, "processes=%u\n", &proc_accounting);
+    fscanf (f, "dedup=%u\n", &dedup);
+    fscanf (f, "wireguardport=%u\n", &wireguard_port);
+    quota_read (f);
     fclose (f);
   } else {
     g_print ("rc file is not found\n");
   }
+  checkpoint_recover ();
+  iface_resolve ();
+
+  g_thread_init(NULL);
 
-  /* open logfile */
-  log_file = fopen (LOGNAME, "a");
-  g_print ("log file ptr = %p\n", log_file);
-  if (log_file == NULL) {
-    g_print ("logfile cannot be opened\n");
+  /* open journal, its writer is a thread of its own */
+  journal = journal_open (JOURNALNAME, journal_sync);
+  if (journal == NULL) {
+    g_print ("journal cannot be opened\n");
   }
 
-  g_thread_init(NULL);
   gdk_threads_init();
   gtk_init (&argc, &argv);
   window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
@@ -788,6 +5734,16 @@ int main(int argc, char *argv[])
 
   menu = gtk_menu_new ();
   gtk_menu_shell_append (GTK_MENU_SHELL (menu), item);
+  item = gtk_menu_item_new_with_label ("Processes");
+  gtk_menu_shell_append (GTK_MENU_SHELL (menu), item);
+  g_signal_connect_swapped (G_OBJECT (item), "activate",
+                            G_CALLBACK (show_processes),
+                            (gpointer) "view.processes");
+  item = gtk_menu_item_new_with_label ("Statistics");
+  gtk_menu_shell_append (GTK_MENU_SHELL (menu), item);
+  g_signal_connect_swapped (G_OBJECT (item), "activate",
+                            G_CALLBACK (show_statistics),
+                            (gpointer) "view.statistics");
 
   item = gtk_menu_item_new_with_label ("View");
   gtk_menu_item_set_submenu (GTK_MENU_ITEM (item), menu);
@@ -807,6 +5763,11 @@ int main(int argc, char *argv[])
   g_signal_connect_swapped (G_OBJECT (item), "activate",
                             G_CALLBACK (set_limits),
                             (gpointer) "Hard limit");
+  item = gtk_check_menu_item_new_with_label ("Per-process accounting");
+  gtk_check_menu_item_set_active (GTK_CHECK_MENU_ITEM (item), proc_accounting);
+  gtk_menu_shell_append (GTK_MENU_SHELL (menu), item);
+  g_signal_connect (G_OBJECT (item), "toggled",
+                    G_CALLBACK (set_proc_accounting), NULL);
   item = gtk_menu_item_new_with_label ("Settings");
   gtk_menu_item_set_submenu (GTK_MENU_ITEM (item), menu);
   gtk_menu_shell_append (GTK_MENU_SHELL (menu_bar), item);
@@ -829,24 +5790,10 @@ int main(int argc, char *argv[])
    * WINDOW BODY
    */
 
+  /* filled by iface_open() below, the list is completed in the background */
   combo = gtk_combo_box_new_text();
-
-  if (pcap_findalldevs(&iflst, errbuf) == -1) {
-		fprintf(stderr, "Couldn't create device list: %s\n", errbuf);
-    return 3;
-  }
-
-  fprintf(stderr, "The following interfaces are available:\n");
-
-  iface = iflst;
-  while (iface) {
-    gtk_combo_box_append_text (GTK_COMBO_BOX(combo), iface->name);
-    fprintf(stderr, "  %s appended\n", iface->name);
-    iface = iface->next;
-  }
-  pcap_freealldevs(iflst);
-
-  gtk_combo_box_set_active (GTK_COMBO_BOX(combo), ifx);
+  g_signal_connect (G_OBJECT (combo), "changed",
+                    G_CALLBACK (device_changed), NULL);
 
   /* Graph */
   frame = gtk_frame_new (NULL);
@@ -914,6 +5861,9 @@ int main(int argc, char *argv[])
   gtk_status_icon_set_visible(tray_icon, FALSE); //set icon initially invisible
   g_signal_connect (G_OBJECT (window), "window-state-event", G_CALLBACK (window_state_event), tray_icon);
 
+  data_mutex = g_mutex_new ();
+  counter_wake_open ();
+  iface_open ();
 
   dev = gtk_combo_box_get_active_text (GTK_COMBO_BOX (combo));
   if (dev != NULL)
@@ -921,12 +5871,52 @@ int main(int argc, char *argv[])
 
   gtk_widget_show_all (window);
   
-  data_mutex = g_mutex_new ();
+
+  checkpoint = checkpoint_open ();
+
+  if (proc_accounting)
+    proc = proc_open ();
+
+  /* counters for external readers */
+  shm = shm_create ();
+  if (shm == NULL) {
+    g_print ("shared memory segment %s cannot be created\n", TM_SHM_NAME);
+  } else {
+    g_mutex_lock (data_mutex);
+    shm_publish ();
+    g_mutex_unlock (data_mutex);
+  }
+  quota_load ();
+  if (nquota > 1)
+    g_timeout_add_seconds (QUOTA_IDLE_TICK, quota_idle_handler, NULL);
+  if (dev != NULL)
+    update_counter_label (FALSE);
+  metrics = metrics_open (metrics_spec);
 
   gdk_threads_enter();
   gtk_main();
   gdk_threads_leave();
 
+  /* quit from the tray menu does not go through delete_event */
+  if (checkpoint != NULL && !checkpoint_close (checkpoint))
+    g_printerr ("Unable to write %s file\n", RCNAME);
+  checkpoint = NULL;
+
+  journal_close (journal);
+  journal = NULL;
+
+  metrics_close (metrics);
+  metrics = NULL;
+
+  g_mutex_lock (data_mutex);
+  old_proc = proc;
+  proc = NULL;
+  g_mutex_unlock (data_mutex);
+  proc_close (old_proc);
+
+  shm_destroy (shm);
+  shm = NULL;
+
   return(0);
 }
 
@@ -0,0 +1,246 @@
+/*
+  TrafficMeter shared memory segment
+  Author: Lajos Zaccomer
+  Contact: lajos at zaccomer dot org
+
+  The running trafficmeter exports its counters in a named shared memory
+  segment. The writer updates it under a sequence lock: seq is odd while an
+  update is in progress, so a reader copies the segment and retries if seq
+  was odd or changed meanwhile. Reading never makes a system call, external
+  monitoring tools only have to include this file and link with GLib:
+
+    tm_shm_reader_t r;
+    tm_shm_t snap;
+
+    if (tm_shm_open(&r)) {
+      if (tm_shm_snapshot(&r, &snap))
+        printf("%llu\n", (unsigned long long)snap.counter);
+      tm_shm_close(&r);
+    }
+*/
+
+#ifndef TRAFFICMETER_SHM_H
+#define TRAFFICMETER_SHM_H
+
+#include <string.h>
+#include <glib.h>
+
+#ifdef WIN32
+#include <windows.h>
+#define TM_SHM_NAME "Local\\trafficmeter"
+#else /* !WIN32 */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define TM_SHM_NAME "/trafficmeter"
+#endif /* !WIN32 */
+
+#define TM_SHM_MAGIC 0x544d5348u   /* "TMSH" */
+#define TM_SHM_VERSION 2            /* bumped on every change of the layout */
+#define TM_SHM_IFACES 8
+#define TM_SHM_HISTORY 64
+#define TM_SHM_TUNNELS 32
+#define TM_SHM_QUOTAS 8
+#define TM_SHM_SIZES 7
+#define TM_SHM_WAKEUPS 3
+#define TM_SHM_RETRIES 1000
+
+/* directions */
+#define TM_SHM_IN 0
+#define TM_SHM_OUT 1
+
+/* limit states */
+#define TM_SHM_LIMIT_OK 0
+#define TM_SHM_LIMIT_SOFT 1
+#define TM_SHM_LIMIT_HARD 2
+
+/* quota windows */
+#define TM_SHM_QUOTA_COUNTER 0           /* since the last reset */
+#define TM_SHM_QUOTA_ROLLING 1           /* param: length in seconds */
+#define TM_SHM_QUOTA_DAY 2               /* calendar day, local time */
+#define TM_SHM_QUOTA_MONTH 3             /* param: day of month it starts on */
+
+/* wakeup sources */
+#define TM_SHM_WAKEUP_TIMER 0            /* the once a second timer */
+#define TM_SHM_WAKEUP_CAPTURE 1          /* the capture thread */
+#define TM_SHM_WAKEUP_REDRAW 2           /* graph redraws */
+
+/* tunnel types, the last tunnel entry collects those that do not fit */
+#define TM_SHM_TUNNEL_NONE 0
+#define TM_SHM_TUNNEL_VLAN 1             /* id: VLAN ID, outer << 12 | inner */
+#define TM_SHM_TUNNEL_GRE 2              /* id: key */
+#define TM_SHM_TUNNEL_VXLAN 3            /* id: VNI */
+#define TM_SHM_TUNNEL_GENEVE 4           /* id: VNI */
+#define TM_SHM_TUNNEL_ESP 5              /* id: SPI */
+#define TM_SHM_TUNNEL_WIREGUARD 6        /* id: receiver index */
+#define TM_SHM_TUNNEL_OTHER 7
+
+typedef struct
+{
+  char    name[32];
+  guint64 bytes[2];               /* indexed by TM_SHM_IN, TM_SHM_OUT */
+  guint64 packets[2];
+  guint32 rate;                   /* bytes in the last completed second */
+  guint32 active;                 /* capture running */
+  guint64 drops;                  /* pcap: dropped by the kernel */
+  guint64 ifdrops;                /* pcap: dropped by the interface */
+  guint64 dup_bytes;              /* suppressed as duplicates */
+  guint64 dup_packets;
+} tm_shm_iface_t;
+
+typedef struct
+{
+  guint32 type;                   /* TM_SHM_TUNNEL_* */
+  guint32 id;
+  guint64 packets;
+  guint64 outer_bytes;            /* as captured, what the link carries */
+  guint64 inner_bytes;            /* the encapsulated packets */
+} tm_shm_tunnel_t;
+
+typedef struct
+{
+  guint32 kind;                   /* TM_SHM_QUOTA_* */
+  guint32 param;
+  guint32 state;                  /* TM_SHM_LIMIT_* */
+  guint32 reserved;
+  guint64 usage;                  /* bytes in the window, once a second */
+  guint64 soft_limit;
+  guint64 hard_limit;
+} tm_shm_quota_t;
+
+typedef struct
+{
+  guint64 seconds;                /* metered since the last reset */
+  guint64 bytes;
+  double  ewma[3];                /* bytes per second over 1, 5, 15 minutes */
+  guint32 p50;                    /* percentiles of the bytes per second */
+  guint32 p95;
+  guint32 p99;
+  guint32 reserved;
+  guint64 sizes[TM_SHM_SIZES];    /* packets up to 64, 127, 255, 511, 1023,
+                                     1518 bytes and above */
+  guint64 size_sum;               /* bytes of the packets in sizes */
+} tm_shm_stats_t;
+
+typedef struct
+{
+  guint64 wakeups[TM_SHM_WAKEUPS];   /* since the start, by TM_SHM_WAKEUP_* */
+  guint32 per_minute[TM_SHM_WAKEUPS]; /* in the last 60 seconds counted */
+  guint32 reserved;
+  guint64 cpu_usec;               /* user and system time of the process */
+} tm_shm_power_t;
+
+typedef struct
+{
+  guint32        magic;
+  guint32        version;
+  guint32        size;            /* sizeof(tm_shm_t) of the writer */
+  volatile gint  seq;             /* odd while being updated */
+  guint32        pid;
+  guint32        niface;
+  gint64         updated;         /* microseconds since the epoch */
+  guint64        counter;         /* the counter on the display */
+  guint64        soft_limit;
+  guint64        hard_limit;
+  guint32        limit_state;     /* TM_SHM_LIMIT_* */
+  guint32        started;
+  tm_shm_iface_t iface[TM_SHM_IFACES];
+  gint64         history_time;    /* seconds since the epoch, newest bucket */
+  guint32        history_len;     /* valid buckets */
+  guint32        history_head;    /* index of the newest bucket */
+  guint32        history[TM_SHM_HISTORY]; /* bytes per second, ring buffer */
+  guint32        ntunnel;         /* valid tunnel entries */
+  guint32        reserved;
+  tm_shm_tunnel_t tunnel[TM_SHM_TUNNELS];
+  guint32        nquota;          /* valid quota entries, the first one is
+                                     the counter with the limits above */
+  guint32        reserved2;
+  tm_shm_quota_t quota[TM_SHM_QUOTAS];
+  tm_shm_stats_t stats;           /* once a second */
+  tm_shm_power_t power;           /* once a second */
+} tm_shm_t;
+
+typedef struct
+{
+  const tm_shm_t *seg;
+#ifdef WIN32
+  HANDLE          handle;
+#endif /* WIN32 */
+} tm_shm_reader_t;
+
+static void tm_shm_close(tm_shm_reader_t *r)
+{
+#ifdef WIN32
+  UnmapViewOfFile((LPCVOID)r->seg);
+  CloseHandle(r->handle);
+#else /* !WIN32 */
+  munmap((void *)r->seg, sizeof(tm_shm_t));
+#endif /* !WIN32 */
+  r->seg = NULL;
+}
+
+/* FALSE if there is no segment or it was written by another revision */
+static gboolean tm_shm_open(tm_shm_reader_t *r)
+{
+#ifdef WIN32
+  MEMORY_BASIC_INFORMATION mbi;
+
+  r->handle = OpenFileMappingA(FILE_MAP_READ, FALSE, TM_SHM_NAME);
+  if (r->handle == NULL)
+    return FALSE;
+  /* the view can only be as large as the mapping, i.e. the writer's size */
+  r->seg = (const tm_shm_t *)MapViewOfFile(r->handle, FILE_MAP_READ, 0, 0, 0);
+  if (r->seg == NULL) {
+    CloseHandle(r->handle);
+    return FALSE;
+  }
+  if (   VirtualQuery(r->seg, &mbi, sizeof(mbi)) != sizeof(mbi)
+      || mbi.RegionSize < sizeof(tm_shm_t)) {
+    tm_shm_close(r);
+    return FALSE;
+  }
+#else /* !WIN32 */
+  struct stat st;
+  void *seg;
+  int fd = shm_open(TM_SHM_NAME, O_RDONLY, 0);
+
+  if (fd < 0)
+    return FALSE;
+  /* a smaller segment of an older writer would fault when read */
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(tm_shm_t)) {
+    close(fd);
+    return FALSE;
+  }
+  seg = mmap(NULL, sizeof(tm_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (seg == MAP_FAILED)
+    return FALSE;
+  r->seg = (const tm_shm_t *)seg;
+#endif /* !WIN32 */
+
+  if (   r->seg->magic != TM_SHM_MAGIC || r->seg->version != TM_SHM_VERSION
+      || r->seg->size < sizeof(tm_shm_t)) {
+    tm_shm_close(r);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* consistent copy of the segment, FALSE if the writer kept it busy */
+static gboolean tm_shm_snapshot(const tm_shm_reader_t *r, tm_shm_t *snap)
+{
+  unsigned int i;
+
+  for (i = 0; i < TM_SHM_RETRIES; ++i) {
+    gint seq = g_atomic_int_get((volatile gint *)&r->seg->seq);
+    if (seq & 1)
+      continue;
+    memcpy(snap, (const void *)r->seg, sizeof(tm_shm_t));
+    if (g_atomic_int_get((volatile gint *)&r->seg->seq) == seq)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+#endif /* TRAFFICMETER_SHM_H */